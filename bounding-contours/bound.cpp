@@ -1,7 +1,128 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 
+#include "batch.hpp"
+
+
+// The kernel size of the blur before thresholding.
+//
+static const int kSize = 3;
+
+// Return a grayscale copy of image blurred by a kernel of size kSize.
+//
+static cv::Mat grayBlur(const cv::Mat &image, int kSize)
+{
+    const cv::Size kernel(kSize, kSize);
+    cv::Mat gray, result;
+    cv::cvtColor(image, gray, cv::COLOR_RGB2GRAY);
+    cv::blur(gray, result, kernel);
+    return result;
+}
+
+// Return thresholds in the blurred gray image at threshold t less than max.
+//
+static const cv::Mat detectThresholds(const cv::Mat &gray,
+                                      double t, double max)
+{
+    cv::Mat result;
+    cv::threshold(gray, result, t, max, cv::THRESH_BINARY);
+    return result;
+}
+
+// Return a random BGR color.
+//
+static cv::Scalar randomColor(void)
+{
+    static cv::RNG rng;
+    const uchar red   = uchar(rng);
+    const uchar green = uchar(rng);
+    const uchar blue  = uchar(rng);
+    return cv::Scalar(blue, green, red);
+}
+
+// Find polygons, rectangles, and circles (center, radius) bounding the
+// contours in contour.  All vectors have the same element count.
+//
+static void findBounds(const std::vector<std::vector<cv::Point> > &contour,
+                       std::vector<std::vector<cv::Point> > &polygon,
+                       std::vector<cv::Rect> &rectangle,
+                       std::vector<cv::Point2f> &center,
+                       std::vector<float> &radius)
+{
+    static const double epsilon = 3.0;
+    static const bool closed = true;
+    const int size = contour.size();
+    for (int i = 0; i < size; ++i) {
+        cv::approxPolyDP(contour[i], polygon[i], epsilon, closed);
+        rectangle[i] = cv::boundingRect(polygon[i]);
+        cv::minEnclosingCircle(polygon[i], center[i], radius[i]);
+    }
+}
+
+// Draw polygons, rectangles, and circles (center, radius) on img in
+// random colors.  All vectors have the same element count.
+//
+// The reference implies that drawContours() ignores hierarchy when
+// maxLevel is 0 though. =tbl
+//
+static void drawBounds(cv::Mat &img,
+                       const std::vector<cv::Vec4i> &hierarchy,
+                       std::vector<std::vector<cv::Point> > &polygon,
+                       std::vector<cv::Rect> &rectangle,
+                       std::vector<cv::Point2f> &center,
+                       std::vector<float> &radius)
+{
+    static const cv::Point offset(0, 0);
+    static const int maxLevel = 0;
+    static const int polyThickness = 1;
+    static const int boundThickness = 2 * polyThickness;
+    static const int lineType = 8;
+    static const int shift = 0;
+    const int size = hierarchy.size();
+    for (int i = 0; i < size; ++i) {
+        const cv::Scalar color = randomColor();
+        const cv::Rect &r = rectangle[i];
+        cv::drawContours(img, polygon, i, color, polyThickness,
+                         lineType, hierarchy, maxLevel, offset);
+        cv::rectangle(img, r.tl(), r.br(),
+                      color, boundThickness, lineType, shift);
+        cv::circle(img, center[i], radius[i], color,
+                   boundThickness, lineType, shift);
+    }
+}
+
+// Find contours with hierarchy in thresholds.
+//
+static void detectContours(const cv::Mat &thresholds,
+                         std::vector<std::vector<cv::Point> > &contour,
+                         std::vector<cv::Vec4i> &hierarchy)
+{
+    static const int mode = cv::RETR_TREE;
+    static const int method = cv::CHAIN_APPROX_SIMPLE;
+    static const cv::Point offset(0, 0);
+    cv::findContours(thresholds, contour, hierarchy, mode, method, offset);
+}
+
+// Draw bounds around contours with hierarchy over black bounds.
+//
+static void showBounds(cv::Mat &bounds,
+                       const std::vector<std::vector<cv::Point> > &contour,
+                       const std::vector<cv::Vec4i> &hierarchy)
+{
+    const int size = contour.size();
+    std::vector<std::vector<cv::Point> > polygon(size);
+    std::vector<cv::Rect> rect(size);
+    std::vector<cv::Point2f> center(size);
+    std::vector<float> radius(size);
+    findBounds(contour, polygon, rect, center, radius);
+    bounds.setTo(cv::Scalar::all(0));
+    drawBounds(bounds, hierarchy, polygon, rect, center, radius);
+}
+
+#ifndef HEADLESS
 
 // Create a new unobscured named window for image.
 // Reset windows layout with when reset is not 0.
@@ -38,122 +159,17 @@ class DemoDisplay {
     int bar;                            // position of threshold trackbar
     const int maxBar;                   // maximum value of trackbar
 
-    // Return a grayscale copy of image blurred by a kernel of size kSize.
-    //
-    static cv::Mat grayBlur(const cv::Mat &image, int kSize) {
-        static const cv::Size kernel(kSize, kSize);
-        cv::Mat gray, result;
-        cv::cvtColor(image, gray, cv::COLOR_RGB2GRAY);
-        cv::blur(gray, result, kernel);
-        return result;
-    }
-
-    // Return thresholds in image at threshold t less than max.
-    //
-    static const cv::Mat detectThresholds(const cv::Mat &image,
-                                          double t, double max)
-    {
-        static const int kSize = 3;
-        static const cv::Size kernel(kSize, kSize);
-        static const cv::Mat grayBlur = DemoDisplay::grayBlur(image, kSize);
-        cv::Mat result;
-        cv::threshold(grayBlur, result, t, max, cv::THRESH_BINARY);
-        return result;
-    }
-
-    // Return a random BGR color.
-    //
-    static cv::Scalar randomColor(void)
-    {
-        static cv::RNG rng;
-        const uchar red   = uchar(rng);
-        const uchar green = uchar(rng);
-        const uchar blue  = uchar(rng);
-        return cv::Scalar(blue, green, red);
-    }
-
-    // Find polygons, rectangles, and circles (center, radius) bounding the
-    // contours in contour.  All vectors have the same element count.
-    //
-    static void findBounds(const std::vector<std::vector<cv::Point> > &contour,
-                           std::vector<std::vector<cv::Point> > &polygon,
-                           std::vector<cv::Rect> &rectangle,
-                           std::vector<cv::Point2f> &center,
-                           std::vector<float> &radius)
-    {
-        static const double epsilon = 3.0;
-        static const bool closed = true;
-        const int size = contour.size();
-        for (int i = 0; i < size; ++i) {
-            cv::approxPolyDP(contour[i], polygon[i], epsilon, closed);
-            rectangle[i] = cv::boundingRect(polygon[i]);
-            cv::minEnclosingCircle(polygon[i], center[i], radius[i]);
-        }
-    }
-
-    // Draw polygons, rectangles, and circles (center, radius) on img in
-    // random colors.  All vectors have the same element count.
-    //
-    // The reference implies that drawContours() ignores hierarchy when
-    // maxLevel is 0 though. =tbl
-    //
-    static void drawBounds(cv::Mat &img,
-                           const std::vector<cv::Vec4i> &hierarchy,
-                           std::vector<std::vector<cv::Point> > &polygon,
-                           std::vector<cv::Rect> &rectangle,
-                           std::vector<cv::Point2f> &center,
-                           std::vector<float> &radius)
-    {
-        static const cv::Point offset(0, 0);
-        static const int maxLevel = 0;
-        static const int polyThickness = 1;
-        static const int boundThickness = 2 * polyThickness;
-        static const int lineType = 8;
-        static const int shift = 0;
-        const int size = hierarchy.size();
-        for (int i = 0; i < size; ++i) {
-            const cv::Scalar color = randomColor();
-            const cv::Rect &r = rectangle[i];
-            cv::drawContours(img, polygon, i, color, polyThickness,
-                             lineType, hierarchy, maxLevel, offset);
-            cv::rectangle(img, r.tl(), r.br(),
-                          color, boundThickness, lineType, shift);
-            cv::circle(img, center[i], radius[i], color,
-                       boundThickness, lineType, shift);
-        }
-    }
-
-
-    // Draw bounds around contours with hierarchy over black bounds.
-    //
-    void showBounds(const std::vector<std::vector<cv::Point> > &contour,
-                    const std::vector<cv::Vec4i> &hierarchy)
-    {
-        static const cv::Mat black
-            = cv::Mat::zeros(bounds.size(), bounds.type());
-        const int size = contour.size();
-        std::vector<std::vector<cv::Point> > polygon(size);
-        std::vector<cv::Rect> rect(size);
-        std::vector<cv::Point2f> center(size);
-        std::vector<float> radius(size);
-        findBounds(contour, polygon, rect, center, radius);
-        black.copyTo(bounds);
-        drawBounds(bounds, hierarchy, polygon, rect, center, radius);
-    }
-
     // Find contours in source, at threshold t less than max, and draw
     // bounding circles and rectangles in some random color on bounds.
     //
     void apply(double t, double max)
     {
-        static const int mode = cv::RETR_TREE;
-        static const int method = cv::CHAIN_APPROX_SIMPLE;
-        static const cv::Point offset(0, 0);
+        static const cv::Mat gray = grayBlur(source, kSize);
         std::vector<std::vector<cv::Point> > contour;
         std::vector<cv::Vec4i> hierarchy;
-        const cv::Mat thresholds = detectThresholds(source, t, max);
-        cv::findContours(thresholds, contour, hierarchy, mode, method, offset);
-        showBounds(contour, hierarchy);
+        const cv::Mat thresholds = detectThresholds(gray, t, max);
+        detectContours(thresholds, contour, hierarchy);
+        showBounds(bounds, contour, hierarchy);
     }
 
     // The callback passed to createTrackbar() where all state is at p.
@@ -197,9 +213,46 @@ public:
     }
 };
 
+#endif
+
+// Write the contour bounds of each image named by input to outDir,
+// thresholding at t less than max.  Report the throughput and the latency
+// of each stage.
+//
+static int runBatch(const char *program, const char *input,
+                    const char *outDir, double t, double max)
+{
+    batch::Batch batch(program, input, outDir);
+    if (!batch) return 1;
+    cv::Mat image, gray, thresholds, bounds;
+    std::vector<std::vector<cv::Point> > contour;
+    std::vector<cv::Vec4i> hierarchy;
+    while (batch.next(image)) {
+        batch.stage("blur", [&]{ gray = grayBlur(image, kSize); });
+        batch.stage("threshold", [&]{
+            thresholds = detectThresholds(gray, t, max);
+        });
+        batch.stage("contours", [&]{
+            detectContours(thresholds, contour, hierarchy);
+        });
+        batch.stage("bounds", [&]{
+            bounds.create(image.size(), CV_8UC3);
+            showBounds(bounds, contour, hierarchy);
+        });
+        batch.write("bounds", bounds);
+    }
+    return 0;
+}
+
 
 int main(int ac, const char *av[])
 {
+    if ((ac == 4 || ac == 5) && 0 == std::strcmp(av[1], "--batch")) {
+        const double t = ac == 5 ? std::atof(av[4]) : 100.0;
+        const double max = std::numeric_limits<uchar>::max();
+        if (0 == runBatch(av[0], av[2], av[3], t, max)) return 0;
+    }
+#ifndef HEADLESS
     if (ac == 2) {
         const cv::Mat image = cv::imread(av[1]);
         if (image.data) {
@@ -213,13 +266,26 @@ int main(int ac, const char *av[])
             return 0;
         }
     }
+#endif
     std::cerr << av[0] << ": Demonstrate bounding polygonal contours."
               << std::endl << std::endl
               << "Usage: " << av[0] << " <image-file>" << std::endl
+              << "   or: " << av[0]
+              << " --batch <input> <output-dir> [<threshold>]" << std::endl
               << std::endl
               << "Where: <image-file> is the name of an image file."
+              << std::endl
+              << "       <input> is an image file, a directory of images,"
+              << std::endl
+              << "               or a .txt file naming one image per line."
+              << std::endl
+              << "       <output-dir> is where to write bounds images."
+              << std::endl
+              << "       <threshold> is from 0 to 255 (default 100)."
               << std::endl << std::endl
               << "Example: " << av[0] << " ../resources/jets.jpg"
+              << std::endl
+              << "Example: " << av[0] << " --batch ../resources bounds"
               << std::endl << std::endl;
     return 1;
 }
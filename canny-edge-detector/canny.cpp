@@ -1,7 +1,39 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 
+#include "batch.hpp"
+
+
+// The kernel size of the blur and of Canny(), and the ratio of the upper
+// to the lower Canny() threshold.
+//
+static const int kSize = 3;
+static const int ratio = 3;
+
+// Return a grayscale copy of image blurred by a kernel of size kSize.
+//
+static cv::Mat grayBlur(const cv::Mat &image, int kSize)
+{
+    const cv::Size kernel(kSize, kSize);
+    cv::Mat gray, result;
+    cv::cvtColor(image, gray, cv::COLOR_RGB2GRAY);
+    cv::blur(gray, result, kernel);
+    return result;
+}
+
+// Return a mask of the edges Canny() detects in gray with threshold.
+//
+static cv::Mat detectEdges(const cv::Mat &gray, double threshold)
+{
+    cv::Mat result;
+    cv::Canny(gray, result, threshold, ratio * threshold, kSize);
+    return result;
+}
+
+#ifndef HEADLESS
 
 // Create a new unobscured named window for image.
 // Reset windows layout with when reset is not 0.
@@ -40,30 +72,15 @@ protected:
     const cv::Mat &srcImage;
     cv::Mat dstImage;
 
-    // Return a grayscale copy of image blurred by a kernel of size kSize.
-    //
-    static cv::Mat grayBlur(const cv::Mat &image, int kSize) {
-        static const cv::Size kernel(kSize, kSize);
-        cv::Mat gray, result;
-        cv::cvtColor(image, gray, cv::COLOR_RGB2GRAY);
-        cv::blur(gray, result, kernel);
-        return result;
-    }
-
     // Apply Canny() with threshold to srcImage to construct an mask of
     // detected edges and overlay that mask back onto srcImage.
     //
     void apply(double threshold)
     {
-        static const int ratio = 3;
-        static const int kSize = 3;
-        static const cv::Size kernel(kSize, kSize);
         static const cv::Mat black
             = cv::Mat::zeros(srcImage.size(), srcImage.type());
-        static const cv::Mat grayBlur
-            = DemoDisplay::grayBlur(srcImage, kSize);
-        cv::Mat edgeMask;
-        cv::Canny(grayBlur, edgeMask, threshold, ratio * threshold, kSize);
+        static const cv::Mat gray = grayBlur(srcImage, kSize);
+        const cv::Mat edgeMask = detectEdges(gray, threshold);
         black.copyTo(dstImage);
         srcImage.copyTo(dstImage, edgeMask);
     }
@@ -117,9 +134,39 @@ public:
     }
 };
 
+#endif
+
+// Write the edge mask and edge overlay of each image named by input to
+// outDir, detecting edges at threshold.  Report the throughput and the
+// latency of each stage.
+//
+static int runBatch(const char *program, const char *input,
+                    const char *outDir, double threshold)
+{
+    batch::Batch batch(program, input, outDir);
+    if (!batch) return 1;
+    cv::Mat image, gray, edgeMask, overlay;
+    while (batch.next(image)) {
+        batch.stage("blur",  [&]{ gray = grayBlur(image, kSize); });
+        batch.stage("canny", [&]{ edgeMask = detectEdges(gray, threshold); });
+        batch.stage("overlay", [&]{
+            overlay = cv::Mat::zeros(image.size(), image.type());
+            image.copyTo(overlay, edgeMask);
+        });
+        batch.write("edges", edgeMask);
+        batch.write("overlay", overlay);
+    }
+    return 0;
+}
+
 
 int main(int ac, const char *av[])
 {
+    if ((ac == 4 || ac == 5) && 0 == std::strcmp(av[1], "--batch")) {
+        const double threshold = ac == 5 ? std::atof(av[4]) : 50.0;
+        if (0 == runBatch(av[0], av[2], av[3], threshold)) return 0;
+    }
+#ifndef HEADLESS
     if (ac == 2) {
         const cv::Mat image = cv::imread(av[1]);
         if (image.data) {
@@ -132,13 +179,26 @@ int main(int ac, const char *av[])
             return 0;
         }
     }
+#endif
     std::cerr << av[0] << ": Demonstrate Canny edge detection."
               << std::endl << std::endl
               << "Usage: " << av[0] << " <image-file>" << std::endl
+              << "   or: " << av[0]
+              << " --batch <input> <output-dir> [<threshold>]" << std::endl
               << std::endl
               << "Where: <image-file> is the name of an image file."
+              << std::endl
+              << "       <input> is an image file, a directory of images,"
+              << std::endl
+              << "               or a .txt file naming one image per line."
+              << std::endl
+              << "       <output-dir> is where to write edge images."
+              << std::endl
+              << "       <threshold> is the Canny threshold (default 50)."
               << std::endl << std::endl
               << "Example: " << av[0] << " ../resources/lena.jpg"
+              << std::endl
+              << "Example: " << av[0] << " --batch ../resources edges"
               << std::endl << std::endl;
     return 1;
 }
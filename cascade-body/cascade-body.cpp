@@ -4,6 +4,8 @@
 
 #include <iostream>
 
+#include "capture.hpp"
+
 
 // A hierarchical Viola-Jones-Lienhart classifier using upper-body, face,
 // and eye Haar Cascade training data.
@@ -127,75 +129,22 @@ static void displayBody(cv::Mat &frame,
 }
 
 
-// Just cv::VideoCapture extended for convenience.  The const_cast<>()s
-// work around the missing member const on cv::VideoCapture::get().
-//
-struct CvVideoCapture: cv::VideoCapture {
-
-    double getFramesPerSecond() const {
-        CvVideoCapture *const p = const_cast<CvVideoCapture *>(this);
-        const double fps = p->get(cv::CAP_PROP_FPS);
-        return fps ? fps : 30.0;        // for MacBook iSight camera
-    }
-
-    int getFourCcCodec() const {
-        CvVideoCapture *const p = const_cast<CvVideoCapture *>(this);
-        return p->get(cv::CAP_PROP_FOURCC);
-    }
-
-    std::string getFourCcCodecString() const {
-        char result[] = "????";
-        CvVideoCapture *const p = const_cast<CvVideoCapture *>(this);
-        const int code = p->getFourCcCodec();
-        result[0] = ((code >>  0) & 0xff);
-        result[1] = ((code >>  8) & 0xff);
-        result[2] = ((code >> 16) & 0xff);
-        result[3] = ((code >> 24) & 0xff);
-        result[4] = ""[0];
-        return std::string(result);
-    }
-
-    int getFrameCount() const {
-        CvVideoCapture *const p = const_cast<CvVideoCapture *>(this);
-        return p->get(cv::CAP_PROP_FRAME_COUNT);
-    }
-
-    cv::Size getFrameSize() const {
-        CvVideoCapture *const p = const_cast<CvVideoCapture *>(this);
-        const int w = p->get(cv::CAP_PROP_FRAME_WIDTH);
-        const int h = p->get(cv::CAP_PROP_FRAME_HEIGHT);
-        const cv::Size result(w, h);
-        return result;
-    }
-
-    int getPosition(void) const {
-        CvVideoCapture *const p = const_cast<CvVideoCapture *>(this);
-        return p->get(cv::CAP_PROP_POS_FRAMES);
-    }
-    void setPosition(int p) { this->set(cv::CAP_PROP_POS_FRAMES, p); }
-
-    CvVideoCapture(const std::string &fileName): VideoCapture(fileName) {}
-    CvVideoCapture(int n): VideoCapture(n) {}
-    CvVideoCapture(): VideoCapture() {}
-};
-
-
-// Return a video capture object suitable for the source string.
-// Return the camera with specified ID if source contains an integer.
+// Open video on the source string.
+// Open the camera with specified ID if source contains an integer.
 // Otherwise attempt to open a video file.
-// Otherwise return the default camera (-1).
+// Otherwise open the default camera (-1).
 //
-static CvVideoCapture openVideo(const char *source)
+static bool openVideo(CvVideoCapture &video, const char *source)
 {
     int cameraId = 0;
     std::istringstream iss(source);
     iss >> cameraId;
-    if (iss) return CvVideoCapture(cameraId);
+    if (iss) return video.open(cameraId);
     std::string filename;
     std::istringstream sss(source);
     sss >> filename;
-    if (sss) return CvVideoCapture(filename);
-    return CvVideoCapture(-1);
+    if (sss) return video.open(filename);
+    return video.open(-1);
 }
 
 int main(int ac, const char *av[])
@@ -205,7 +154,7 @@ int main(int ac, const char *av[])
                   << av[0] << ": Body data from " << av[2] << std::endl
                   << av[0] << ": Face data from " << av[3] << std::endl
                   << av[0] << ": Eyes data from " << av[4] << std::endl;
-        CvVideoCapture camera = openVideo(av[1]);
+        CvVideoCapture camera; openVideo(camera, av[1]);
         cv::CascadeClassifier    bodyHaar(av[2]);
         cv::CascadeClassifier    faceHaar(av[3]);
         cv::CascadeClassifier    eyesHaar(av[4]);
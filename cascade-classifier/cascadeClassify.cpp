@@ -4,6 +4,8 @@
 
 #include <iostream>
 
+#include "capture.hpp"
+
 
 static void showUsage(const char *av0)
 {
@@ -87,44 +89,6 @@ static void displayFace(cv::Mat &frame,
 }
 
 
-// Just cv::VideoCapture extended for convenience.
-//
-struct CvVideoCapture: cv::VideoCapture {
-    double framesPerSecond() {
-        const double fps = this->get(cv::CAP_PROP_FPS);
-        return fps ? fps : 30.0;        // for MacBook iSight camera
-    }
-    int fourCcCodec() {
-        return this->get(cv::CAP_PROP_FOURCC);
-    }
-    const char *fourCcCodecString() {
-        static int code = 0;
-        static char result[5] = "";
-        if (code == 0) {
-            code = this->fourCcCodec();
-            result[0] = ((code & 0x000000ff) >>  0);
-            result[1] = ((code & 0x0000ff00) >>  8);
-            result[2] = ((code & 0x00ff0000) >> 16);
-            result[3] = ((code & 0xff000000) >> 24);
-            result[4] = ""[0];
-        }
-        return result;
-    }
-    int frameCount() {
-        return this->get(cv::CAP_PROP_FRAME_COUNT);
-    }
-    cv::Size frameSize() {
-        const int w = this->get(cv::CAP_PROP_FRAME_WIDTH);
-        const int h = this->get(cv::CAP_PROP_FRAME_HEIGHT);
-        const cv::Size result(w, h);
-        return result;
-    }
-    CvVideoCapture(const std::string &fileName): VideoCapture(fileName) {}
-    CvVideoCapture(int n): VideoCapture(n) {}
-    CvVideoCapture(): VideoCapture() {}
-};
-
-
 int main(int ac, const char *av[])
 {
     if (ac == 4) {
@@ -139,7 +103,7 @@ int main(int ac, const char *av[])
             CvVideoCapture camera(cameraId);
             std::cout << std::endl << av[0] << ": Press any key to quit."
                       << std::endl << std::endl;
-            const int msPerFrame = 1000.0 / camera.framesPerSecond();
+            const int msPerFrame = 1000.0 / camera.getFramesPerSecond();
             while (true) {
                 cv::Mat frame; camera >> frame;
                 if (!frame.empty()) {
@@ -0,0 +1,216 @@
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/utility.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+// A header-only batch runner for the image tutorials.  It uses only the
+// image codecs in highgui, and never opens a window or waits for a key,
+// so it runs without a display.
+//
+// A Batch walks the images named by a directory, a .txt file with one
+// image path per line, or a single image file.  The program times each
+// stage of its processing with stage(), writes its results to an output
+// directory with write(), and the Batch reports images per second and
+// the latency of each stage when it goes out of scope.
+//
+namespace batch {
+
+// The latencies of every run of one named stage.
+//
+struct Stage {
+    std::string name;
+    std::vector<double> ms;
+    Stage(const std::string &n): name(n) {}
+};
+
+class Batch {
+
+    const std::string program;          // the name of the program run
+    const std::string outDir;           // where write() puts results
+    std::vector<std::string> names;     // the image files to process
+    size_t index;                       // the next name to read
+    std::string stem;                   // the name of the current image
+    std::vector<Stage> stages;          // every stage in order of first run
+    int imageCount;                     // images read so far
+    int64 tickZero;                     // when the Batch started
+
+    // True if path is a directory.
+    //
+    static bool isDirectory(const std::string &path) {
+        struct stat s;
+        return 0 == stat(path.c_str(), &s) && S_ISDIR(s.st_mode);
+    }
+
+    // Return the lower-case extension of path including the dot.
+    //
+    static std::string extension(const std::string &path) {
+        const size_t dot = path.find_last_of('.');
+        const size_t slash = path.find_last_of('/');
+        if (dot == std::string::npos) return std::string();
+        if (slash != std::string::npos && dot < slash) return std::string();
+        std::string result = path.substr(dot);
+        for (size_t i = 0; i < result.size(); ++i) {
+            result[i] = std::tolower(result[i]);
+        }
+        return result;
+    }
+
+    // True if path names a file imread() should be able to read.
+    //
+    static bool isImage(const std::string &path) {
+        static const char *const known[] = {
+            ".bmp", ".jpeg", ".jpg", ".pbm", ".pgm", ".png", ".ppm",
+            ".tif", ".tiff"
+        };
+        static const int count = sizeof known / sizeof known[0];
+        const std::string ext = extension(path);
+        for (int i = 0; i < count; ++i) if (ext == known[i]) return true;
+        return false;
+    }
+
+    // Return the file name of path without directory or extension.
+    //
+    static std::string stemOf(const std::string &path) {
+        const size_t slash = path.find_last_of('/');
+        const size_t begin = slash == std::string::npos ? 0 : slash + 1;
+        const size_t dot = path.find_last_of('.');
+        const size_t end = dot == std::string::npos || dot < begin
+            ? path.size() : dot;
+        return path.substr(begin, end - begin);
+    }
+
+    // Return the image files named by input.
+    //
+    static std::vector<std::string> listImages(const std::string &input) {
+        std::vector<std::string> result;
+        if (isDirectory(input)) {
+            std::vector<cv::String> all;
+            cv::glob(input + "/*", all, false);
+            for (size_t i = 0; i < all.size(); ++i) {
+                if (isImage(all[i])) result.push_back(all[i]);
+            }
+        } else if (extension(input) == ".txt") {
+            std::ifstream is(input.c_str());
+            std::string line;
+            while (std::getline(is, line)) {
+                if (!line.empty()) result.push_back(line);
+            }
+        } else {
+            result.push_back(input);
+        }
+        return result;
+    }
+
+    // Return the Stage named name, adding it if it is new.
+    //
+    Stage &find(const std::string &name) {
+        for (size_t i = 0; i < stages.size(); ++i) {
+            if (stages[i].name == name) return stages[i];
+        }
+        stages.push_back(Stage(name));
+        return stages.back();
+    }
+
+    // Return the milliseconds since tick.
+    //
+    static double msSince(int64 tick) {
+        return (cv::getTickCount() - tick) * 1000.0 / cv::getTickFrequency();
+    }
+
+public:
+
+    // True if there are images to process and somewhere to write results.
+    //
+    operator bool() const { return !names.empty() && isDirectory(outDir); }
+
+    // Read the next image into image, skipping files that do not read.
+    // Return false when there are no more images.
+    //
+    bool next(cv::Mat &image) {
+        while (index < names.size()) {
+            const std::string &name = names[index++];
+            const int64 tick = cv::getTickCount();
+            image = cv::imread(name, cv::IMREAD_COLOR);
+            if (image.data) {
+                find("read").ms.push_back(msSince(tick));
+                stem = stemOf(name);
+                ++imageCount;
+                return true;
+            }
+            std::cerr << program << ": Cannot read " << name << std::endl;
+        }
+        return false;
+    }
+
+    // Call f() as the stage named name of the current image.
+    //
+    template <typename Function>
+    void stage(const std::string &name, Function f) {
+        const int64 tick = cv::getTickCount();
+        f();
+        find(name).ms.push_back(msSince(tick));
+    }
+
+    // Write image as the suffix result of the current image to outDir.
+    //
+    void write(const std::string &suffix, const cv::Mat &image) {
+        const std::string path = outDir + "/" + stem + "-" + suffix + ".png";
+        const int64 tick = cv::getTickCount();
+        if (!cv::imwrite(path, image)) {
+            std::cerr << program << ": Cannot write " << path << std::endl;
+        }
+        find("write").ms.push_back(msSince(tick));
+    }
+
+    // Show on os the images per second and the mean, median, and maximum
+    // latency of each stage.
+    //
+    void report(std::ostream &os) const {
+        const double seconds = msSince(tickZero) / 1000.0;
+        os << std::setiosflags(std::ios::fixed) << std::setprecision(3)
+           << program << ": " << imageCount << " images in " << seconds
+           << " seconds: " << (seconds ? imageCount / seconds : 0.0)
+           << " images/second" << std::endl;
+        for (size_t i = 0; i < stages.size(); ++i) {
+            std::vector<double> ms = stages[i].ms;
+            std::sort(ms.begin(), ms.end());
+            double total = 0.0;
+            for (size_t j = 0; j < ms.size(); ++j) total += ms[j];
+            os << "    " << std::left << std::setw(12) << stages[i].name
+               << std::right
+               << "  mean "   << std::setw(9) << total / ms.size()
+               << "  median " << std::setw(9) << ms[ms.size() / 2]
+               << "  max "    << std::setw(9) << ms.back() << " ms"
+               << std::endl;
+        }
+    }
+
+    ~Batch() { if (imageCount) report(std::cout); }
+
+    // Process the images named by input in program, writing to outDir.
+    // Create outDir if it does not exist.
+    //
+    Batch(const char *p, const std::string &input, const std::string &o):
+        program(p), outDir(o), names(listImages(input)), index(0),
+        imageCount(0), tickZero(cv::getTickCount())
+    {
+        if (!isDirectory(outDir)) mkdir(outDir.c_str(), 0777);
+    }
+};
+
+}
+
+#endif
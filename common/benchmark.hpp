@@ -0,0 +1,265 @@
+#ifndef BENCHMARK_HPP
+#define BENCHMARK_HPP
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/utility.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+// A header-only micro-benchmark harness shared by the tutorials.
+//
+// A Harness times named cases, each tagged with the parameters of the
+// sweep that produced it, and reports each on std::cout as it finishes.
+// With --csv <file> or --json <file> on the command line it also writes
+// every case to file when it goes out of scope, and runs in batch mode
+// with no windows, for nightly regression tracking.
+//
+namespace bench {
+
+// True when a Harness is writing machine-readable results, so the
+// program should not open windows or wait for keys.
+//
+inline bool &batch(void)
+{
+    static bool result = false;
+    return result;
+}
+
+// The name=value parameters of a case, in the order they were added.
+//
+struct Params: std::vector<std::pair<std::string, std::string> > {
+    template <typename T> Params &add(const std::string &name, const T &v) {
+        std::ostringstream os; os << v;
+        this->push_back(std::make_pair(name, os.str()));
+        return *this;
+    }
+    Params &add(const Params &params) {
+        this->insert(this->end(), params.begin(), params.end());
+        return *this;
+    }
+};
+
+// The timing of runCount runs of a named case that scans pixels pixels
+// of bytes bytes in each run.
+//
+struct Result {
+    std::string name;                   // the name of the case
+    Params params;                      // the sweep parameters of the case
+    int runCount;                       // the number of timed runs
+    double pixels;                      // pixels scanned per run
+    double bytes;                       // bytes scanned per run
+    double minMs;                       // the fastest run
+    double medianMs;                    // the median run
+    double p99Ms;                       // the 99th percentile run
+    double meanMs;                      // the average run
+    double cyclesPerByte;               // median CPU cycles per byte
+
+    double nsPerPixel(void) const {
+        return pixels ? medianMs * 1e6 / pixels : 0.0;
+    }
+    double megapixelsPerSecond(void) const {
+        return medianMs ? pixels / medianMs / 1000 : 0.0;
+    }
+};
+
+class Harness {
+
+    enum Format { TEXT, CSV, JSON };
+
+    const std::string suite;            // the name of the program timed
+    Format format;                      // how to write results to fileName
+    std::string fileName;               // where to write results
+    std::vector<Result> results;        // every case run so far
+
+    // Return s without trailing blanks.
+    //
+    static std::string trim(const std::string &s) {
+        const size_t end = s.find_last_not_of(' ');
+        return end == std::string::npos ? std::string() : s.substr(0, end + 1);
+    }
+
+    // Return s quoted for JSON.
+    //
+    static std::string quote(const std::string &s) {
+        std::string result("\"");
+        for (size_t i = 0; i < s.size(); ++i) {
+            if (s[i] == '"' || s[i] == '\\') result += '\\';
+            result += s[i];
+        }
+        return result + "\"";
+    }
+
+    // Return s quoted for CSV.
+    //
+    static std::string csvQuote(const std::string &s) {
+        std::string result("\"");
+        for (size_t i = 0; i < s.size(); ++i) {
+            if (s[i] == '"') result += '"';
+            result += s[i];
+        }
+        return result + "\"";
+    }
+
+    // Return params joined as name=value;name=value for CSV.
+    //
+    static std::string join(const Params &params) {
+        std::string result;
+        for (size_t i = 0; i < params.size(); ++i) {
+            if (i) result += ";";
+            result += params[i].first + "=" + params[i].second;
+        }
+        return result;
+    }
+
+    // Show r on os as one line of text.
+    //
+    static void showText(std::ostream &os, const Result &r) {
+        os << std::setiosflags(std::ios::fixed) << std::setprecision(3)
+           << r.name
+           << "  min "      << std::setw(8) << r.minMs
+           << "  median "   << std::setw(8) << r.medianMs
+           << "  p99 "      << std::setw(8) << r.p99Ms
+           << " ms  "       << std::setw(7) << r.nsPerPixel()
+           << " ns/pixel  " << std::setw(8) << r.megapixelsPerSecond()
+           << " MP/s  "     << std::setw(7) << r.cyclesPerByte
+           << " cycles/byte" << std::endl;
+    }
+
+    void writeCsv(std::ostream &os) const {
+        os << "suite,case,params,runs,pixels,bytes,min_ms,median_ms,"
+           << "p99_ms,mean_ms,ns_per_pixel,mp_per_s,cycles_per_byte"
+           << std::endl << std::setprecision(6);
+        for (size_t i = 0; i < results.size(); ++i) {
+            const Result &r = results[i];
+            os << csvQuote(suite) << "," << csvQuote(r.name)
+               << "," << csvQuote(join(r.params))
+               << "," << r.runCount << "," << r.pixels << "," << r.bytes
+               << "," << r.minMs << "," << r.medianMs << "," << r.p99Ms
+               << "," << r.meanMs << "," << r.nsPerPixel()
+               << "," << r.megapixelsPerSecond()
+               << "," << r.cyclesPerByte << std::endl;
+        }
+    }
+
+    void writeJson(std::ostream &os) const {
+        os << "{" << quote("suite") << ": " << quote(suite) << ", "
+           << quote("cases") << ": [" << std::setprecision(6);
+        for (size_t i = 0; i < results.size(); ++i) {
+            const Result &r = results[i];
+            os << (i ? "," : "") << std::endl
+               << "  {" << quote("case") << ": " << quote(r.name)
+               << ", " << quote("params") << ": {";
+            for (size_t j = 0; j < r.params.size(); ++j) {
+                os << (j ? ", " : "") << quote(r.params[j].first) << ": "
+                   << quote(r.params[j].second);
+            }
+            os << "}, "
+               << quote("runs")            << ": " << r.runCount << ", "
+               << quote("pixels")          << ": " << r.pixels << ", "
+               << quote("bytes")           << ": " << r.bytes << ", "
+               << quote("min_ms")          << ": " << r.minMs << ", "
+               << quote("median_ms")       << ": " << r.medianMs << ", "
+               << quote("p99_ms")          << ": " << r.p99Ms << ", "
+               << quote("mean_ms")         << ": " << r.meanMs << ", "
+               << quote("ns_per_pixel")    << ": " << r.nsPerPixel() << ", "
+               << quote("mp_per_s")        << ": "
+               << r.megapixelsPerSecond() << ", "
+               << quote("cycles_per_byte") << ": " << r.cyclesPerByte << "}";
+        }
+        os << std::endl << "]}" << std::endl;
+    }
+
+    void write(std::ostream &os) const {
+        if (format == CSV) writeCsv(os);
+        if (format == JSON) writeJson(os);
+    }
+
+public:
+
+    int warmCount;                      // untimed runs before timing a case
+    Params context;                     // parameters common to every case
+
+    // Run f() warmCount times, then time runCount more runs of it one by
+    // one.  Show the result on std::cout and keep it for the report.
+    //
+    template <typename Function>
+    const Result &run(const std::string &name, const Params &params,
+                      int runCount, double pixels, double bytes, Function f)
+    {
+        std::vector<int64> ticks(runCount), cycles(runCount);
+        for (int i = 0; i < warmCount; ++i) f();
+        for (int i = 0; i < runCount; ++i) {
+            const int64 cycleZero = cv::getCPUTickCount();
+            const int64 tickZero = cv::getTickCount();
+            f();
+            ticks[i] = cv::getTickCount() - tickZero;
+            cycles[i] = cv::getCPUTickCount() - cycleZero;
+        }
+        double totalTicks = 0.0;
+        for (int i = 0; i < runCount; ++i) totalTicks += ticks[i];
+        std::sort(ticks.begin(), ticks.end());
+        std::sort(cycles.begin(), cycles.end());
+        const int p99 = std::min(runCount - 1, runCount * 99 / 100);
+        const double msPerTick = 1000.0 / cv::getTickFrequency();
+        Result r;
+        r.name = name;
+        r.params.add(context).add(params);
+        r.runCount = runCount;
+        r.pixels = pixels;
+        r.bytes = bytes;
+        r.minMs = ticks[0] * msPerTick;
+        r.medianMs = ticks[runCount / 2] * msPerTick;
+        r.p99Ms = ticks[p99] * msPerTick;
+        r.meanMs = totalTicks * msPerTick / runCount;
+        r.cyclesPerByte = bytes ? cycles[runCount / 2] / bytes : 0.0;
+        showText(std::cout, r);
+        r.name = trim(name);
+        results.push_back(r);
+        return results.back();
+    }
+
+    // Write the report of every case run to fileName.
+    //
+    ~Harness() {
+        if (format == TEXT) return;
+        std::ofstream os(fileName.c_str());
+        write(os);
+        if (!os) std::cerr << suite << ": Cannot write " << fileName
+                           << std::endl;
+    }
+
+    // Time the cases of the program named suite.  Remove --csv <file> or
+    // --json <file> from the ac arguments in av, and set batch() if
+    // either is there.
+    //
+    Harness(const char *s, int &ac, const char *av[]):
+        suite(s), format(TEXT), warmCount(10)
+    {
+        int out = 0;
+        for (int in = 0; in < ac; ++in) {
+            const bool csv = 0 == std::strcmp(av[in], "--csv");
+            const bool json = 0 == std::strcmp(av[in], "--json");
+            if ((csv || json) && in + 1 < ac) {
+                format = csv ? CSV : JSON;
+                fileName = av[++in];
+            } else {
+                av[out++] = av[in];
+            }
+        }
+        ac = out;
+        batch() = format != TEXT;
+    }
+};
+
+}
+
+#endif
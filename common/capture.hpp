@@ -0,0 +1,277 @@
+#ifndef CAPTURE_HPP
+#define CAPTURE_HPP
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+// A video capture shared by the video tutorials that decodes on a
+// background thread into a ring of preallocated frames, so decoding the
+// next frames overlaps the processing of the current one.
+//
+// The >> operator pops the oldest decoded frame and waits only when the
+// ring is empty.  When the ring is full the decoder follows a Policy:
+//
+// BLOCK       waits for room and loses no frames (the default for files)
+// DROP_OLDEST discards the oldest frame in the ring to keep latency low
+//             (the default for cameras)
+// DROP_NEWEST discards the frame it just decoded
+//
+// The properties of the video are read once when it opens, so the getters
+// never touch the cv::VideoCapture the decoder thread is reading.
+//
+class CvVideoCapture {
+
+public:
+
+    enum Policy { BLOCK, DROP_OLDEST, DROP_NEWEST };
+
+private:
+
+    // A decoded frame, its position in the video, and the tick count when
+    // it was decoded.
+    //
+    struct Slot { cv::Mat frame; int position; int64 tick; };
+
+    cv::VideoCapture video;             // read only by the decoder thread
+    std::vector<Slot> ring;             // frames decoded but not popped
+    cv::Mat spare;                      // the decoder's next frame
+    Policy policy;                      // what to do when ring is full
+    size_t head;                        // the oldest frame in ring
+    size_t count;                       // the number of frames in ring
+    int decodePosition;                 // the next frame to decode
+    int position;                       // the frame after the last popped
+    int dropCount;                      // frames dropped by policy
+    bool opened;                        // true if video is open
+    bool done;                          // true when the decoder is done
+    bool stop;                          // true to stop the decoder
+
+    double fps;                         // frames per second
+    int fourCc;                         // the codec
+    int frameCount;                     // 0 for cameras
+    cv::Size frameSize;                 // the size of each frame
+
+    mutable std::mutex mutex;           // guards all of the above
+    std::condition_variable ready;      // a frame is in ring or done
+    std::condition_variable room;       // ring has room or stop
+    std::thread decoder;                // runs decode()
+
+    // Read frames from video into ring until the end of the video or
+    // until stop.
+    //
+    void decode(void) {
+        while (true) {
+            const bool ok = video.read(spare);
+            const int64 tick = cv::getTickCount();
+            std::unique_lock<std::mutex> lock(mutex);
+            if (stop) return;
+            if (!ok) {
+                done = true;
+                ready.notify_all();
+                return;
+            }
+            const int p = decodePosition++;
+            if (count == ring.size()) {
+                if (policy == DROP_NEWEST) { ++dropCount; continue; }
+                if (policy == DROP_OLDEST) {
+                    head = (head + 1) % ring.size(); --count; ++dropCount;
+                } else {
+                    room.wait(lock, [this]{
+                        return stop || count < ring.size();
+                    });
+                    if (stop) return;
+                }
+            }
+            Slot &slot = ring[(head + count) % ring.size()];
+            std::swap(slot.frame, spare);
+            slot.position = p;
+            slot.tick = tick;
+            ++count;
+            ready.notify_one();
+        }
+    }
+
+    // Stop the decoder thread and wait for it.
+    //
+    void halt(void) {
+        if (decoder.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            room.notify_all();
+            decoder.join();
+        }
+    }
+
+    // Empty ring and start decoding from frame p.
+    //
+    void start(int p) {
+        head = count = 0;
+        decodePosition = position = p;
+        stop = false;
+        done = !opened;
+        if (opened) decoder = std::thread(&CvVideoCapture::decode, this);
+    }
+
+    // Read the properties of the newly opened video, preallocate the ring
+    // and start decoding.
+    //
+    bool begin(void) {
+        opened = video.isOpened();
+        fps = opened ? video.get(cv::CAP_PROP_FPS) : 0.0;
+        fourCc = opened ? video.get(cv::CAP_PROP_FOURCC) : 0;
+        frameCount = opened ? video.get(cv::CAP_PROP_FRAME_COUNT) : 0;
+        const int w = opened ? video.get(cv::CAP_PROP_FRAME_WIDTH) : 0;
+        const int h = opened ? video.get(cv::CAP_PROP_FRAME_HEIGHT) : 0;
+        frameSize = cv::Size(w, h);
+        if (frameSize.area()) {
+            for (size_t i = 0; i < ring.size(); ++i) {
+                ring[i].frame.create(frameSize, CV_8UC3);
+            }
+            spare.create(frameSize, CV_8UC3);
+        }
+        dropCount = 0;
+        start(0);
+        return opened;
+    }
+
+    CvVideoCapture(const CvVideoCapture &);
+    CvVideoCapture &operator=(const CvVideoCapture &);
+
+public:
+
+    double getFramesPerSecond() const {
+        return fps ? fps : 30.0;        // for MacBook iSight camera
+    }
+
+    int getFourCcCodec() const { return fourCc; }
+
+    std::string getFourCcCodecString() const {
+        char result[] = "????";
+        const int code = getFourCcCodec();
+        result[0] = ((code >>  0) & 0xff);
+        result[1] = ((code >>  8) & 0xff);
+        result[2] = ((code >> 16) & 0xff);
+        result[3] = ((code >> 24) & 0xff);
+        result[4] = ""[0];
+        return std::string(result);
+    }
+
+    int getFrameCount() const { return frameCount; }
+
+    cv::Size getFrameSize() const { return frameSize; }
+
+    // Return the position of the frame after the last one popped.
+    //
+    int getPosition(void) const { return position; }
+
+    // Discard the decoded frames and resume decoding at frame p.  Do
+    // nothing if p is already the next frame, as when a trackbar callback
+    // echoes back the position just shown.
+    //
+    void setPosition(int p) {
+        if (opened && p == position) return;
+        halt();
+        video.set(cv::CAP_PROP_POS_FRAMES, p);
+        start(p);
+    }
+
+    // Return the number of frames the Policy has dropped.
+    //
+    int getDropCount(void) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return dropCount;
+    }
+
+    bool isOpened(void) const { return opened; }
+
+    bool open(const std::string &fileName, Policy p = BLOCK) {
+        release();
+        policy = p;
+        video.open(fileName);
+        return begin();
+    }
+
+    bool open(int n, Policy p = DROP_OLDEST) {
+        release();
+        policy = p;
+        video.open(n);
+        return begin();
+    }
+
+    void release(void) {
+        halt();
+        video.release();
+        opened = false;
+        start(0);
+    }
+
+    // Copy the oldest decoded frame into frame and return true.  Wait for
+    // the decoder if none is ready.  Release frame and return false at the
+    // end of the video.
+    //
+    // The frame is copied out, rather than handed over, so nothing the
+    // caller keeps can alias a frame the decoder will overwrite.
+    //
+    bool read(cv::Mat &frame) {
+        int64 tick;
+        return read(frame, tick);
+    }
+
+    // Read as above, and set tick to the cv::getTickCount() when frame
+    // was decoded, to measure the latency of processing it.
+    //
+    bool read(cv::Mat &frame, int64 &tick) {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [this]{ return count || done; });
+        if (count == 0) {
+            frame.release();
+            return false;
+        }
+        Slot &slot = ring[head];
+        slot.frame.copyTo(frame);
+        tick = slot.tick;
+        position = slot.position + 1;
+        head = (head + 1) % ring.size();
+        --count;
+        room.notify_one();
+        return true;
+    }
+
+    CvVideoCapture &operator>>(cv::Mat &frame) {
+        read(frame);
+        return *this;
+    }
+
+    ~CvVideoCapture() { halt(); }
+
+    // Capture from fileName or camera n decoding up to depth frames ahead
+    // according to policy.
+    //
+    CvVideoCapture(const std::string &fileName,
+                   int depth = 4, Policy p = BLOCK):
+        video(fileName), ring(std::max(1, depth)), policy(p)
+    {
+        begin();
+    }
+    CvVideoCapture(int n, int depth = 4, Policy p = DROP_OLDEST):
+        video(n), ring(std::max(1, depth)), policy(p)
+    {
+        begin();
+    }
+
+    // An unopened capture that decodes 4 frames ahead without dropping.
+    //
+    CvVideoCapture(): ring(4), policy(BLOCK) { begin(); }
+};
+
+#endif
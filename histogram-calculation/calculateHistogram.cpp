@@ -1,7 +1,24 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
+#include <cstring>
 #include <iostream>
 
+#include "batch.hpp"
+
+
+// The planes of a color image in split() order, with the color in which
+// to draw the histogram of each and its name.
+//
+static const int maxColor = std::numeric_limits<unsigned char>::max();
+enum { BLUE, GREEN, RED, COLORCOUNT };
+static const struct { cv::Scalar value; const char *name; } color[] = {
+    [BLUE]  = { cv::Scalar(maxColor,        0,        0), "blue"  },
+    [GREEN] = { cv::Scalar(       0, maxColor,        0), "green" },
+    [RED]   = { cv::Scalar(       0,        0, maxColor), "red"   }
+};
+static const int binCount = 1 + maxColor; // a bin for each of [0..max]
+
+#ifndef HEADLESS
 
 // Create a new unobscured named window for image.
 // Reset windows layout with when reset is not 0.
@@ -28,6 +45,8 @@ static void makeWindow(const char *window, const cv::Mat &image, int reset = 0)
     maxY = std::max(maxY, image.rows);
 }
 
+#endif
+
 // Return a normalized histogram across binCount bins for plane.
 //
 static cv::Mat_<float> normalizedHistogram(const cv::Mat &plane, int binCount)
@@ -69,19 +88,13 @@ static void drawHistogram(cv::Mat &image,
     }
 }
 
+#ifndef HEADLESS
+
 // Return a new image with a histogram of colors in image after displaying
 // each channel of image in a separate window.
 //
 static cv::Mat computeHistogram(const cv::Mat &image)
 {
-    static const int max = std::numeric_limits<unsigned char>::max();
-    enum { BLUE, GREEN, RED, COLORCOUNT };
-    static const struct { cv::Scalar value; const char *name; } color[] = {
-        [BLUE]  = { cv::Scalar(max,   0,   0), "blue"  },
-        [GREEN] = { cv::Scalar(  0, max,   0), "green" },
-        [RED]   = { cv::Scalar(  0,   0, max), "red"   }
-    };
-    static const int binCount = 1 + max; // a bin for each of [0..max]
     cv::Mat result = cv::Mat_<cv::Vec3b>::zeros(image.rows, image.cols);
     cv::Mat plane[COLORCOUNT];
     cv::split(image, plane);
@@ -93,8 +106,43 @@ static cv::Mat computeHistogram(const cv::Mat &image)
     return result;
 }
 
+#endif
+
+// Write a histogram of the colors in each image named by input to outDir.
+// Report the throughput and the latency of each stage.
+//
+static int runBatch(const char *program, const char *input,
+                    const char *outDir)
+{
+    batch::Batch batch(program, input, outDir);
+    if (!batch) return 1;
+    cv::Mat image, result;
+    cv::Mat plane[COLORCOUNT];
+    cv::Mat_<float> hist[COLORCOUNT];
+    while (batch.next(image)) {
+        batch.stage("split", [&]{ cv::split(image, plane); });
+        batch.stage("histogram", [&]{
+            for (int c = 0; c < COLORCOUNT; ++c) {
+                hist[c] = normalizedHistogram(plane[c], binCount);
+            }
+        });
+        batch.stage("draw", [&]{
+            result = cv::Mat_<cv::Vec3b>::zeros(image.rows, image.cols);
+            for (int c = 0; c < COLORCOUNT; ++c) {
+                drawHistogram(result, hist[c], color[c].value);
+            }
+        });
+        batch.write("histogram", result);
+    }
+    return 0;
+}
+
 int main(int ac, const char *av[])
 {
+    if (ac == 4 && 0 == std::strcmp(av[1], "--batch")) {
+        if (0 == runBatch(av[0], av[2], av[3])) return 0;
+    }
+#ifndef HEADLESS
     if (ac == 2) {
         const cv::Mat image = cv::imread(av[1]);
         if (image.data) {
@@ -106,13 +154,23 @@ int main(int ac, const char *av[])
             return 0;
         }
     }
+#endif
     std::cerr << av[0] << ": Demonstrate histogram equalization."
               << std::endl << std::endl
               << "Usage: " << av[0] << " <image-file>" << std::endl
-              << std::endl
+              << "   or: " << av[0] << " --batch <input> <output-dir>"
+              << std::endl << std::endl
               << "Where: <image-file> is the name of an image file."
+              << std::endl
+              << "       <input> is an image file, a directory of images,"
+              << std::endl
+              << "               or a .txt file naming one image per line."
+              << std::endl
+              << "       <output-dir> is where to write histograms."
               << std::endl << std::endl
               << "Example: " << av[0] << " ../resources/lena.jpg"
+              << std::endl
+              << "Example: " << av[0] << " --batch ../resources histograms"
               << std::endl << std::endl;
     return 1;
 }
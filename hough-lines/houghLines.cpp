@@ -1,7 +1,11 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
+#include <cstring>
 #include <iostream>
 
+#include "batch.hpp"
+
+#ifndef HEADLESS
 
 // Create a new unobscured named window for image.
 // Reset windows layout with when reset is not 0.
@@ -28,6 +32,8 @@ static void makeWindow(const char *window, const cv::Mat &image, int reset = 0)
     maxY = std::max(maxY, image.rows);
 }
 
+#endif
+
 static cv::Mat cannyDetect(const cv::Mat &image)
 {
     static const double threshold1 =  50;
@@ -95,8 +101,36 @@ static cv::Mat probableHough(const cv::Mat &cannyImg, const cv::Mat &colorImg)
     return result;
 }
 
+// Write the Canny edges and both Hough line images of each image named by
+// input to outDir.  Report the throughput and the latency of each stage.
+//
+static int runBatch(const char *program, const char *input,
+                    const char *outDir)
+{
+    batch::Batch batch(program, input, outDir);
+    if (!batch) return 1;
+    cv::Mat image, cannyImage, sHough, pHough;
+    while (batch.next(image)) {
+        batch.stage("canny", [&]{ cannyImage = cannyDetect(image); });
+        batch.stage("standard", [&]{
+            sHough = standardHough(cannyImage, image);
+        });
+        batch.stage("probable", [&]{
+            pHough = probableHough(cannyImage, image);
+        });
+        batch.write("canny", cannyImage);
+        batch.write("standard", sHough);
+        batch.write("probable", pHough);
+    }
+    return 0;
+}
+
 int main(int ac, const char *av[])
 {
+    if (ac == 4 && 0 == std::strcmp(av[1], "--batch")) {
+        if (0 == runBatch(av[0], av[2], av[3])) return 0;
+    }
+#ifndef HEADLESS
     if (ac == 2) {
         const cv::Mat image = cv::imread(av[1]);
         if (image.data) {
@@ -111,13 +145,23 @@ int main(int ac, const char *av[])
             return 0;
         }
     }
+#endif
     std::cerr << av[0] << ": Demonstrate line finding with Hough transform."
               << std::endl << std::endl
               << "Usage: " << av[0] << " <image-file>" << std::endl
-              << std::endl
+              << "   or: " << av[0] << " --batch <input> <output-dir>"
+              << std::endl << std::endl
               << "Where: <image-file> is the name of an image file."
+              << std::endl
+              << "       <input> is an image file, a directory of images,"
+              << std::endl
+              << "               or a .txt file naming one image per line."
+              << std::endl
+              << "       <output-dir> is where to write line images."
               << std::endl << std::endl
               << "Example: " << av[0] << " ../resources/building.jpg"
+              << std::endl
+              << "Example: " << av[0] << " --batch ../resources lines"
               << std::endl << std::endl;
     return 1;
 }
@@ -1,9 +1,17 @@
 ﻿#include <opencv2/core/core.hpp>
 #include <opencv2/core/utility.hpp>
 #include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <iomanip>
 #include <iostream>
 #include <sstream>
 
+#include "benchmark.hpp"
+
+#if defined(__SSSE3__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 // Show a usage message on cout for program named av0.
 //
 static void showUsage(const char *av0)
@@ -11,9 +19,22 @@ static void showUsage(const char *av0)
     std::cout
         << av0 << ": Time scanning a Mat with the C operator[] method, "
         << std::endl
-        << "    matrix iterators, the at() function, and the LUT() function."
+        << "    matrix iterators, the at() function, the LUT() function,"
+        << std::endl
+        << "    and byte-shuffle table lookups."
+        << std::endl
+        << "    Then time cv::parallel_for_() over row bands of the image"
+        << std::endl
+        << "    with 1, 2, 4, ... up to one thread per CPU."
+        << std::endl
+        << "    Then time quantizers specialized at compile time for"
+        << std::endl
+        << "    the image's channel count and divisors of 8, 16, and 32."
         << std::endl << std::endl
         << "Usage: " << av0 << " <image-file> <divisor> [g]"
+        << " [-n <runs>] [-s <width>x<height>]"
+        << std::endl
+        << "       [--csv <file> | --json <file>]"
         << std::endl << std::endl
         << "Where: <image-file> is the path to an image file."
         << std::endl
@@ -22,12 +43,29 @@ static void showUsage(const char *av0)
         << "       <divisor> is a small integer less than 255."
         << std::endl
         << "       g means process the image in gray scale."
+        << std::endl
+        << "       <runs> is how many timed runs of each scan to make."
+        << std::endl
+        << "              The default is 200."
+        << std::endl
+        << "       <width>x<height> resizes the image before scanning"
+        << std::endl
+        << "              so machines can be compared on the same size."
+        << std::endl
+        << "       --csv or --json writes every timing to <file>"
+        << std::endl
+        << "              without showing any windows."
         << std::endl << std::endl
         << "Example: " << av0 << " ../resources/Twas_Ever_Thus500.jpg 10"
         << std::endl
         << "Read an image object from Twas_Ever_Thus500 into a cv::Mat."
         << std::endl
         << "Repeatedly divide the image's native color palette by 10."
+        << std::endl << std::endl
+        << "Example: " << av0 << " ../resources/Twas_Ever_Thus500.jpg 10"
+        << " g -n 1000 -s 1920x1080"
+        << std::endl
+        << "Do the same to a 1920x1080 gray scale copy 1000 times."
         << std::endl << std::endl;
 }
 
@@ -38,6 +76,7 @@ static void showUsage(const char *av0)
 //
 static void makeWindow(const char *window, const cv::Mat &image, int reset = 0)
 {
+    if (bench::batch()) return;
     static int across = 1;
     static int count, moveX, moveY, maxY = 0;
     if (reset) {
@@ -56,18 +95,40 @@ static void makeWindow(const char *window, const cv::Mat &image, int reset = 0)
     maxY = std::max(maxY, image.rows);
 }
 
-// Return divisor after loading an image file into img.
+// Return divisor after loading an image file into img, resizing it if
+// the command line asks to, and setting runCount.
 // Return 0 after showing a usage message if there's a problem.
 //
-static int useCommandLine(int ac, const char *av[], cv::Mat &img)
+static int useCommandLine(int ac, const char *av[], cv::Mat &img,
+                          int &runCount)
 {
     if (ac > 2) {
         int divisor = 0;
         std::stringstream ss; ss << av[2]; ss >> divisor;
-        if (ss && divisor) {
-            const bool g = (ac == 4) && (*"g" == *av[3]);
+        bool ok = ss && divisor;
+        bool g = false;
+        cv::Size size;
+        runCount = 200;
+        for (int i = 3; ok && i < ac; ++i) {
+            const std::string arg(av[i]);
+            if (arg == "g") {
+                g = true;
+            } else if (arg == "-n" && i + 1 < ac) {
+                std::stringstream ns; ns << av[++i]; ns >> runCount;
+                ok = ns && runCount > 0;
+            } else if (arg == "-s" && i + 1 < ac) {
+                char x = 0;
+                std::stringstream ws; ws << av[++i];
+                ws >> size.width >> x >> size.height;
+                ok = ws && x == 'x' && size.width > 0 && size.height > 0;
+            } else {
+                ok = false;
+            }
+        }
+        if (ok) {
             const int cogOpt = g? cv::IMREAD_GRAYSCALE: cv::IMREAD_COLOR;
             img = cv::imread(av[1], cogOpt);
+            if (img.data && size.area()) cv::resize(img, img, size);
             if (img.data) return divisor;
         }
     }
@@ -76,38 +137,59 @@ static int useCommandLine(int ac, const char *av[], cv::Mat &img)
 }
 
 
-// Call scan(*this) a lot and report the average run time in milliseconds.
+// Call scan(*this) a lot and report the distribution of its run times.
 //
-// After cloning image, scan() visits every element, reduces it according
-// to table, and returns the result.
+// scan() visits every element of image, reduces it according to table,
+// and writes the result into reduced -- which is allocated like image
+// once, before any runs, so the timed runs allocate and copy nothing.
 //
-// Each test() runs scan() many times and reports its average run time.
+// Each test() has harness run scan() runCount times as a case named
+// label with params, then shows the result in a window.  Call time()
+// instead to skip the window.
 //
 struct Test {
+    bench::Harness &harness;
     const cv::Mat &table;
     const cv::Mat &image;
     const char *const label;
-    cv::Mat (*scan)(const struct Test &);
-
-    void operator()(void) const {
-        static const int runCount = 200;
-        cv::Mat reduced;
-        const int64 tickZero = cv::getTickCount();
-        for (int i = 0; i < runCount; ++i) reduced = (*scan)(*this);
-        const int64 ticks = cv::getTickCount() - tickZero;
-        const double totalSeconds = (double)ticks / cv::getTickFrequency();
-        const double msPerRun = totalSeconds * 1000 / runCount;
-        std::cout << "Average " << label << " time in milliseconds: "
-                  << msPerRun << std::endl;
-        makeWindow(label, reduced);
-    }
-
-    Test(const cv::Mat &lut, const cv::Mat &i, const char *m,
-         cv::Mat (*s)(const struct Test &)):
-        table(lut), image(i), label(m), scan(s) {}
+    void (*scan)(const struct Test &, cv::Mat &reduced);
+    const int runCount;
+
+    void operator()(const bench::Params &params) const {
+        makeWindow(label, time(params));
+    }
+
+    cv::Mat time(const bench::Params &params) const {
+        cv::Mat reduced(image.size(), image.type());
+        const double pixels = image.total();
+        const double bytes = pixels * image.elemSize();
+        harness.run(label, params, runCount, pixels, bytes,
+                    [&] { (*scan)(*this, reduced); });
+        return reduced;
+    }
+
+    Test(bench::Harness &h, const cv::Mat &lut, const cv::Mat &i,
+         const char *m, void (*s)(const struct Test &, cv::Mat &), int n):
+        harness(h), table(lut), image(i), label(m), scan(s), runCount(n) {}
 };
 
 
+// Return the number of rows to scan in image and reduced, and set nCols
+// to the number of elements in each row.  Scan an image that is
+// isContinuous() as one long row.
+//
+static int rowsToScan(const cv::Mat &image, const cv::Mat &reduced,
+                      int &nCols)
+{
+    nCols = image.cols * image.channels();
+    if (image.isContinuous() && reduced.isContinuous()) {
+        nCols *= image.rows;
+        return 1;
+    }
+    return image.rows;
+}
+
+
 // Scan t.image using C's native array [] on rows pulled via Mat::ptr<>(),
 // while also pulling a native lookup table from t.table.data.  This is
 // generally the most efficient scanning method, and can be even better
@@ -117,21 +199,16 @@ struct Test {
 // LUT() as in scanWithLut() is much more convenient and about as fast when
 // processing an entire matrix with a lookup table.
 //
-static cv::Mat scanWithArrayOp(const Test &t)
+static void scanWithArrayOp(const Test &t, cv::Mat &reduced)
 {
-    cv::Mat image = t.image.clone();
-    int nRows = image.rows;
-    int nCols = image.cols * image.channels();
-    if (image.isContinuous()) {
-        nCols *= nRows;
-        nRows = 1;
-    }
+    int nCols = 0;
+    const int nRows = rowsToScan(t.image, reduced, nCols);
     const uchar *const table = t.table.data;
     for (int i = 0; i < nRows; ++i) {
-        uchar *const p = image.ptr<uchar>(i);
-        for (int j = 0; j < nCols; ++j) p[j] = table[p[j]];
+        const uchar *const p = t.image.ptr<uchar>(i);
+        uchar *const q = reduced.ptr<uchar>(i);
+        for (int j = 0; j < nCols; ++j) q[j] = table[p[j]];
     }
-    return image;
 }
 
 
@@ -140,28 +217,28 @@ static cv::Mat scanWithArrayOp(const Test &t)
 // but not its channels().  This is slower but safer than
 // scanWithArrayOp(), and has performance similar to scanWithAt().
 //
-static cv::Mat scanWithMatIter(const Test &t)
+static void scanWithMatIter(const Test &t, cv::Mat &reduced)
 {
-    cv::Mat image = t.image.clone();
     const uchar *const table = t.table.data;
-    switch (image.channels()) {
+    switch (t.image.channels()) {
     case 1: {
-        cv::MatIterator_<uchar> it = image.begin<uchar>();
-        const cv::MatIterator_<uchar> end = image.end<uchar>();
-        for ( ; it != end; ++it) *it = table[*it];
+        cv::MatConstIterator_<uchar> it = t.image.begin<uchar>();
+        const cv::MatConstIterator_<uchar> end = t.image.end<uchar>();
+        cv::MatIterator_<uchar> out = reduced.begin<uchar>();
+        for ( ; it != end; ++it, ++out) *out = table[*it];
         break;
     }
     case 3: {
-        cv::MatIterator_<cv::Vec3b> it = image.begin<cv::Vec3b>();
-        const cv::MatIterator_<cv::Vec3b> end = image.end<cv::Vec3b>();
-        for( ; it != end; ++it) {
-            (*it)[0] = table[(*it)[0]];
-            (*it)[1] = table[(*it)[1]];
-            (*it)[2] = table[(*it)[2]];
+        cv::MatConstIterator_<cv::Vec3b> it = t.image.begin<cv::Vec3b>();
+        const cv::MatConstIterator_<cv::Vec3b> end = t.image.end<cv::Vec3b>();
+        cv::MatIterator_<cv::Vec3b> out = reduced.begin<cv::Vec3b>();
+        for( ; it != end; ++it, ++out) {
+            (*out)[0] = table[(*it)[0]];
+            (*out)[1] = table[(*it)[1]];
+            (*out)[2] = table[(*it)[2]];
         }
     }
     }
-    return image;
 }
 
 
@@ -179,33 +256,32 @@ static cv::Mat scanWithMatIter(const Test &t)
 // This performs comparable to scanWithMatIter() and is more convenient
 // for random access modification of an image rather than scanning it.
 //
-static cv::Mat scanWithAt(const Test &t)
+static void scanWithAt(const Test &t, cv::Mat &reduced)
 {
-    cv::Mat image = t.image.clone();
+    const cv::Mat &image = t.image;
     const uchar *const table = t.table.data;
     switch (image.channels()) {
     case 1: {
         for (int i = 0; i < image.rows; ++i) {
             for (int j = 0; j < image.cols; ++j) {
-                image.at<uchar>(i,j) = table[image.at<uchar>(i,j)];
+                reduced.at<uchar>(i,j) = table[image.at<uchar>(i,j)];
             }
         }
         break;
     }
     case 3: {
-        cv::Mat_<cv::Vec3b> head = image;
+        const cv::Mat_<cv::Vec3b> head = image;
+        cv::Mat_<cv::Vec3b> out = reduced;
         for (int i = 0; i < image.rows; ++i) {
             for (int j = 0; j < image.cols; ++j) {
-                head(i,j)[0] = table[head(i,j)[0]];
-                head(i,j)[1] = table[head(i,j)[1]];
-                head(i,j)[2] = table[head(i,j)[2]];
+                out(i,j)[0] = table[head(i,j)[0]];
+                out(i,j)[1] = table[head(i,j)[1]];
+                out(i,j)[2] = table[head(i,j)[2]];
             }
         }
-        image = head;
         break;
     }
     }
-    return image;
 }
 
 
@@ -215,30 +291,249 @@ static cv::Mat scanWithAt(const Test &t)
 // entire matrix, and is most convenient when there is a lookup table
 // already computed.
 //
-static cv::Mat scanWithLut(const Test &t)
+static void scanWithLut(const Test &t, cv::Mat &reduced)
+{
+    LUT(t.image, t.table, reduced);
+}
+
+
+// The 256 entries of a lookup table split into 16 banks of 16 bytes
+// each, one bank for each value of the high nibble of an element.
+//
+// A byte shuffle looks up a whole vector of elements in one bank at once:
+// each element's low nibble picks a byte from the bank, and an element
+// with its high bit set shuffles to 0.  Subtracting 16 from every element
+// before visiting the next bank brings that bank's elements down to 0-15,
+// and a saturating add of 0x70 sets the high bit of every element outside
+// 0-15.  So OR-ing the 16 shuffles together reduces the whole vector.
+//
+struct ShuffleLut {
+    const uchar *const table;
+#if defined(__AVX2__)
+    __m256i bank[16];
+#elif defined(__SSSE3__)
+    __m128i bank[16];
+#endif
+
+    // Write to q the table entries for the n elements at p.
+    //
+    void operator()(const uchar *p, uchar *q, int n) const {
+        int j = 0;
+#if defined(__AVX2__)
+        const __m256i sixteen = _mm256_set1_epi8(16);
+        const __m256i highBit = _mm256_set1_epi8(0x70);
+        for (; j + 32 <= n; j += 32) {
+            __m256i index = _mm256_loadu_si256((const __m256i *)(p + j));
+            __m256i result = _mm256_setzero_si256();
+            for (int k = 0; k < 16; ++k) {
+                const __m256i i = _mm256_adds_epu8(index, highBit);
+                const __m256i r = _mm256_shuffle_epi8(bank[k], i);
+                result = _mm256_or_si256(result, r);
+                index = _mm256_sub_epi8(index, sixteen);
+            }
+            _mm256_storeu_si256((__m256i *)(q + j), result);
+        }
+#elif defined(__SSSE3__)
+        const __m128i sixteen = _mm_set1_epi8(16);
+        const __m128i highBit = _mm_set1_epi8(0x70);
+        for (; j + 16 <= n; j += 16) {
+            __m128i index = _mm_loadu_si128((const __m128i *)(p + j));
+            __m128i result = _mm_setzero_si128();
+            for (int k = 0; k < 16; ++k) {
+                const __m128i i = _mm_adds_epu8(index, highBit);
+                const __m128i r = _mm_shuffle_epi8(bank[k], i);
+                result = _mm_or_si128(result, r);
+                index = _mm_sub_epi8(index, sixteen);
+            }
+            _mm_storeu_si128((__m128i *)(q + j), result);
+        }
+#endif
+        for (; j < n; ++j) q[j] = table[p[j]];
+    }
+
+    ShuffleLut(const cv::Mat &lut): table(lut.data) {
+#if defined(__SSSE3__) || defined(__AVX2__)
+        for (int k = 0; k < 16; ++k) {
+            const __m128i *const b = (const __m128i *)(table + 16 * k);
+#if defined(__AVX2__)
+            bank[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128(b));
+#else
+            bank[k] = _mm_loadu_si128(b);
+#endif
+        }
+#endif
+    }
+};
+
+
+// Scan t.image like scanWithArrayOp() but reduce 32 (AVX2) or 16 (SSSE3)
+// elements at a time with byte shuffles through the banks of a
+// ShuffleLut.  Elements left over at the end of a row, or all of them
+// when compiled without SSSE3, go through the same scalar loop as
+// scanWithArrayOp().
+//
+static void scanWithShuffle(const Test &t, cv::Mat &reduced)
 {
-    cv::Mat image = t.image.clone();
-    LUT(t.image, t.table, image);
-    return image;
+    const ShuffleLut lut(t.table);
+    int nCols = 0;
+    const int nRows = rowsToScan(t.image, reduced, nCols);
+    for (int i = 0; i < nRows; ++i) {
+        lut(t.image.ptr<uchar>(i), reduced.ptr<uchar>(i), nCols);
+    }
+}
+
+
+// Reduce the rows in a band of image through table into reduced.
+//
+// cv::parallel_for_() calls this once per band, each band on some thread
+// from its pool, and each band reduced 32 or 16 elements at a time by a
+// ShuffleLut -- so the scan runs out of memory bandwidth before it runs
+// out of cores.
+//
+struct ReduceBand: cv::ParallelLoopBody {
+    const cv::Mat &image;
+    cv::Mat &reduced;
+    const ShuffleLut lut;
+    void operator()(const cv::Range &band) const {
+        const int nCols = image.cols * image.channels();
+        for (int i = band.start; i < band.end; ++i) {
+            lut(image.ptr<uchar>(i), reduced.ptr<uchar>(i), nCols);
+        }
+    }
+    ReduceBand(const cv::Mat &i, cv::Mat &r, const cv::Mat &table):
+        image(i), reduced(r), lut(table) {}
+};
+
+// Scan t.image in cv::getNumThreads() bands of rows at once.
+//
+// Set the thread count with cv::setNumThreads() before calling this.
+//
+static void scanWithParallelFor(const Test &t, cv::Mat &reduced)
+{
+    const ReduceBand reduce(t.image, reduced, t.table);
+    const int bandCount = cv::getNumThreads();
+    cv::parallel_for_(cv::Range(0, t.image.rows), reduce, bandCount);
+}
+
+// Time scanWithParallelFor() on image with 1, 2, 4, ... threads up to
+// one thread per CPU, then restore the thread count and show the result.
+//
+// The time stops improving once the threads together saturate memory
+// bandwidth, so the thread count where it levels off is the most worth
+// spending on a scan like this.
+//
+static void showThreadScaling(bench::Harness &harness,
+                              const cv::Mat &table, const cv::Mat &image,
+                              int runCount)
+{
+    const int savedCount = cv::getNumThreads();
+    const int cpuCount = cv::getNumberOfCPUs();
+    cv::Mat reduced;
+    for (int n = 1; n; n = n == cpuCount? 0: std::min(2 * n, cpuCount)) {
+        std::ostringstream os; os << "threads " << std::setw(2) << n;
+        const std::string label = os.str();
+        cv::setNumThreads(n);
+        const Test test(harness, table, image, label.c_str(),
+                        &scanWithParallelFor, runCount);
+        reduced = test.time(bench::Params().add("threads", n));
+    }
+    cv::setNumThreads(savedCount);
+    makeWindow("parallel_for_()", reduced);
+}
+
+
+// Reduce t.image of Channels channels by Divisor into reduced without a
+// lookup table, ignoring t.table.
+//
+// With Divisor known at compile time, Divisor * (x / Divisor) becomes a
+// multiply and shift -- or just a mask when Divisor is a power of 2 --
+// and the Channels loop unrolls, so the compiler can vectorize the scan
+// of a whole row without any SIMD code here.
+//
+template <int Channels, int Divisor>
+static void scanQuantized(const Test &t, cv::Mat &reduced)
+{
+    int nCols = 0;
+    const int nRows = rowsToScan(t.image, reduced, nCols);
+    const int nPixels = nCols / Channels;
+    for (int i = 0; i < nRows; ++i) {
+        const uchar *p = t.image.ptr<uchar>(i);
+        uchar *q = reduced.ptr<uchar>(i);
+        for (int j = 0; j < nPixels; ++j, p += Channels, q += Channels) {
+            for (int c = 0; c < Channels; ++c) {
+                q[c] = Divisor * (p[c] / Divisor);
+            }
+        }
+    }
+}
+
+// Time scanQuantized<Channels, Divisor>() on image against the generic
+// operator[] scan through a table for the same Divisor, for each Divisor
+// the quantizer is specialized for.  Show the last result.
+//
+template <int Channels>
+static void showQuantizers(bench::Harness &harness, const cv::Mat &image,
+                           int runCount)
+{
+    typedef void (*Scan)(const Test &, cv::Mat &);
+    static const struct { int divisor; Scan scan; } quantizers[] = {
+        {  8, &scanQuantized<Channels,  8> },
+        { 16, &scanQuantized<Channels, 16> },
+        { 32, &scanQuantized<Channels, 32> }
+    };
+    const int quantizersCount = sizeof quantizers / sizeof quantizers[0];
+    cv::Mat table(1, 256, CV_8U), reduced;
+    for (int i = 0; i < quantizersCount; ++i) {
+        const int divisor = quantizers[i].divisor;
+        uchar *const p = table.data;
+        for (int k = 0; k < table.cols; ++k) p[k] = divisor * (k / divisor);
+        std::ostringstream gos, qos;
+        gos << "[] / " << std::setw(2) << divisor << "   ";
+        qos << "<" << Channels << ", " << std::setw(2) << divisor << ">   ";
+        const std::string genericLabel = gos.str();
+        const std::string quantizerLabel = qos.str();
+        const Test generic(harness, table, image, genericLabel.c_str(),
+                           &scanWithArrayOp, runCount);
+        const Test quantizer(harness, table, image, quantizerLabel.c_str(),
+                             quantizers[i].scan, runCount);
+        const bench::Params params = bench::Params().add("divisor", divisor);
+        generic.time(params);
+        reduced = quantizer.time(params);
+    }
+    makeWindow("scanQuantized<>()", reduced);
 }
 
 
 int main(int ac, const char *av[])
 {
+    bench::Harness harness("how-to-scan-images", ac, av);
     cv::Mat image, table(1, 256, CV_8U);
-    const int divisor = useCommandLine(ac, av, image);
+    int runCount = 0;
+    const int divisor = useCommandLine(ac, av, image, runCount);
     if (divisor == 0 || CV_8U != image.depth()) return 1;
     makeWindow(av[1], image, 3);
+    std::cout << image.cols << "x" << image.rows << " image with "
+              << image.channels() << " channels, " << runCount
+              << " runs per scan" << std::endl;
+    harness.context.add("width", image.cols).add("height", image.rows)
+        .add("channels", image.channels());
     uchar *const p = table.data;
     for (int i = 0; i < table.cols; ++i) p[i] = (divisor * (i / divisor));
     const Test tests[] = {
-        Test(table, image, "operator[]", &scanWithArrayOp),
-        Test(table, image, "iterator  ", &scanWithMatIter),
-        Test(table, image, "at()      ", &scanWithAt),
-        Test(table, image, "LUT()     ", &scanWithLut)
+        Test(harness, table, image, "operator[]", &scanWithArrayOp, runCount),
+        Test(harness, table, image, "iterator  ", &scanWithMatIter, runCount),
+        Test(harness, table, image, "at()      ", &scanWithAt,      runCount),
+        Test(harness, table, image, "LUT()     ", &scanWithLut,     runCount),
+        Test(harness, table, image, "shuffle   ", &scanWithShuffle, runCount)
     };
     const int testsCount = sizeof tests / sizeof tests[0];
-    for (int i = 0; i < testsCount; ++i) (tests[i])();
-    cv::waitKey(0);
+    const bench::Params params = bench::Params().add("divisor", divisor);
+    for (int i = 0; i < testsCount; ++i) (tests[i])(params);
+    showThreadScaling(harness, table, image, runCount);
+    switch (image.channels()) {
+    case 1: showQuantizers<1>(harness, image, runCount); break;
+    case 3: showQuantizers<3>(harness, image, runCount); break;
+    }
+    if (!bench::batch()) cv::waitKey(0);
     return 0;
 }
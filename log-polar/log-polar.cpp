@@ -2,6 +2,8 @@
 #include <opencv2/imgproc.hpp>
 #include <iostream>
 
+#include "capture.hpp"
+
 
 // Create a new unobscured named window for image.
 // Reset windows layout with when reset is not 0.
@@ -27,53 +29,6 @@ static void makeWindow(const char *window, cv::Size size, int reset = 0)
     maxY = std::max(maxY, size.height);
 }
 
-// Just cv::VideoCapture extended for the convenience of PlayWithLogPolar.
-//
-struct CvVideoCapture: cv::VideoCapture {
-
-    double getFramesPerSecond() {
-        const double fps = this->get(cv::CAP_PROP_FPS);
-        return fps ? fps : 30.0;        // for MacBook iSight camera
-    }
-
-    int getFourCcCodec() {
-        return this->get(cv::CAP_PROP_FOURCC);
-    }
-
-    const char *getFourCcCodecString() {
-        static int code = 0;
-        static char result[5] = "";
-        if (code == 0) {
-            code = this->getFourCcCodec();
-            result[0] = ((code & 0x000000ff) >>  0);
-            result[1] = ((code & 0x0000ff00) >>  8);
-            result[2] = ((code & 0x00ff0000) >> 16);
-            result[3] = ((code & 0xff000000) >> 24);
-            result[4] = ""[0];
-        }
-        return result;
-    }
-
-    int getFrameCount() {
-        return this->get(cv::CAP_PROP_FRAME_COUNT);
-    }
-
-    cv::Size getFrameSize() {
-        const int w = this->get(cv::CAP_PROP_FRAME_WIDTH);
-        const int h = this->get(cv::CAP_PROP_FRAME_HEIGHT);
-        const cv::Size result(w, h);
-        return result;
-    }
-
-    int getPosition(void) { return this->get(cv::CAP_PROP_POS_FRAMES); }
-    void setPosition(int p) { this->set(cv::CAP_PROP_POS_FRAMES, p); }
-
-    CvVideoCapture(const std::string &fileName): VideoCapture(fileName) {}
-    CvVideoCapture(int n): VideoCapture(n) {}
-    CvVideoCapture(): VideoCapture() {}
-};
-
-
 // Play video from file transformed by cv::logPolar() with title at FPS or
 // by stepping frames using a trackbar as a scrub control.
 //
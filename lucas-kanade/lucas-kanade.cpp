@@ -1,7 +1,22 @@
+#include "opencv2/core/utility.hpp"
 #include "opencv2/highgui.hpp"
 #include "opencv2/video/tracking.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <mutex>
+#include <thread>
+
+#include "capture.hpp"
 
 
 // Show the hot-keys on os.
@@ -14,6 +29,8 @@ static void showKeys(std::ostream &os, const char *av0)
        << av0 << ": q to quit the program." << std::endl
        << av0 << ": t to find good tracking points." << std::endl
        << av0 << ": c to clear all tracking points." << std::endl
+       << av0 << ": a to toggle automatic replenishment of points."
+       << std::endl
        << av0 << ": n to toggle the backing video display." << std::endl
        << std::endl
        << av0 << ": Click the mouse to add a tracking point." << std::endl
@@ -30,12 +47,42 @@ static void showUsage(const char *av0)
 {
     std::cerr << av0 << ": Demonstrate Lucas-Kanade optical flow tracking."
               << std::endl << std::endl
-              << "Usage: " << av0 << " <video>" << std::endl << std::endl
+              << "Usage: " << av0 << " <video> [--points <count>]"
+              << std::endl
+              << "   or: " << av0 << " <video> --export <tracks>"
+              << " [--points <count>]"
+              << std::endl << std::endl
               << "Where: <video> is an optional video file." << std::endl
-              << "       If <video> is '-' use a camera instead." << std::endl
+              << "       If <video> is '-' use a camera instead."
+              << std::endl
+              << "       A camera is tracked on its own thread, dropping"
+              << std::endl
+              << "       frames to keep latency low."
+              << std::endl
+              << "       <tracks> is a file to write the tracks of points"
+              << std::endl
+              << "                found automatically in <video> without"
+              << std::endl
+              << "                a display: CSV if it ends in .csv, or"
+              << std::endl
+              << "                else binary.  Points are replenished"
+              << std::endl
+              << "                automatically as they are lost."
               << std::endl
+              << "       <count> is the most points to track (default 500)."
+              << std::endl
+              << "               Thousands of points are tracked in shards"
+              << std::endl
+              << "               on every CPU."
+              << std::endl << std::endl
               << "Example: " << av0 << " - # use a camera" << std::endl
               << "Example: " << av0 << " ../resources/Megamind.avi"
+              << std::endl
+              << "Example: " << av0 << " ../resources/Megamind.avi"
+              << " --export tracks.csv"
+              << std::endl
+              << "Example: " << av0 << " ../resources/Megamind.avi"
+              << " --export tracks.lkt --points 20000"
               << std::endl << std::endl;
     showKeys(std::cerr, av0);
 }
@@ -52,57 +99,187 @@ static cv::TermCriteria makeTerminationCriteria(void)
 }
 
 
-// Just cv::VideoCapture extended for the convenience of
-// LucasKanadeVideoPlayer.  The const_cast<>()s work around
-// the missing member const on cv::VideoCapture::get().
+// Write the tracked points of each frame to a file, as CSV lines of
+// frame,id,x,y or in a compact binary format of records in host byte
+// order:
+//
+// header: "LKT1"
+// frame:  int32 frame, int32 n, then n of { int32 id, float x, float y }
 //
-struct CvVideoCapture: cv::VideoCapture {
+class TrajectoryWriter {
+
+    std::ofstream os;                   // the trajectory file
+    const bool csv;                     // true for CSV, false for binary
+
+    // True if fileName ends in .csv.
+    //
+    static bool isCsv(const char *fileName) {
+        const size_t n = strlen(fileName);
+        return n >= 4 && 0 == strcmp(fileName + n - 4, ".csv");
+    }
 
-    double getFramesPerSecond() const {
-        CvVideoCapture *const p = const_cast<CvVideoCapture *>(this);
-        const double fps = p->get(cv::CAP_PROP_FPS);
-        return fps ? fps : 30.0;        // for MacBook iSight camera
+    template <typename T> void put(const T &value) {
+        os.write((const char *)&value, sizeof value);
     }
 
-    int getFourCcCodec() const {
-        CvVideoCapture *const p = const_cast<CvVideoCapture *>(this);
-        return p->get(cv::CAP_PROP_FOURCC);
+public:
+
+    // True if the file is still good.
+    //
+    operator bool() const { return bool(os); }
+
+    // Write the points of frame with their ids.
+    //
+    void write(int frame, const std::vector<int> &ids,
+               const std::vector<cv::Point2f> &points) {
+        const int32_t n = points.size();
+        if (csv) {
+            for (int i = 0; i < n; ++i) {
+                os << frame << "," << ids[i] << ","
+                   << points[i].x << "," << points[i].y << "\n";
+            }
+            return;
+        }
+        put(int32_t(frame));
+        put(n);
+        for (int i = 0; i < n; ++i) {
+            put(int32_t(ids[i]));
+            put(points[i].x);
+            put(points[i].y);
+        }
     }
 
-    std::string getFourCcCodecString() const {
-        char result[] = "????";
-        CvVideoCapture *const p = const_cast<CvVideoCapture *>(this);
-        const int code = p->getFourCcCodec();
-        result[0] = ((code >>  0) & 0xff);
-        result[1] = ((code >>  8) & 0xff);
-        result[2] = ((code >> 16) & 0xff);
-        result[3] = ((code >> 24) & 0xff);
-        result[4] = ""[0];
-        return std::string(result);
+    TrajectoryWriter(const char *fileName):
+        os(fileName, std::ios::binary), csv(isCsv(fileName))
+    {
+        if (csv) {
+            os << "frame,id,x,y" << std::endl;
+        } else {
+            os.write("LKT1", 4);
+        }
+    }
+};
+
+
+// The points tracked in a frame as a structure of arrays.  The flow
+// calculation sees the points as one contiguous array it can cut into
+// shards, and lost tracks are compacted away in place without
+// reallocating.
+//
+struct Tracks {
+    std::vector<cv::Point2f> points;    // where each track is
+    std::vector<int> ids;               // the id of each track
+    std::vector<uchar> status;          // true if tracked into this frame
+    std::vector<float> error;           // the flow error of each track
+
+    size_t size(void) const { return points.size(); }
+    bool empty(void) const { return points.empty(); }
+
+    void resize(size_t n) {
+        points.resize(n);
+        ids.resize(n);
+        status.resize(n);
+        error.resize(n);
     }
 
-    int getFrameCount() const {
-        CvVideoCapture *const p = const_cast<CvVideoCapture *>(this);
-        return p->get(cv::CAP_PROP_FRAME_COUNT);
+    void clear(void) { resize(0); }
+
+    // Add a track at point with id.
+    //
+    void add(const cv::Point2f &point, int id) {
+        points.push_back(point);
+        ids.push_back(id);
+        status.push_back(true);
+        error.push_back(0.0f);
     }
 
-    cv::Size getFrameSize() const {
-        CvVideoCapture *const p = const_cast<CvVideoCapture *>(this);
-        const int w = p->get(cv::CAP_PROP_FRAME_WIDTH);
-        const int h = p->get(cv::CAP_PROP_FRAME_HEIGHT);
-        const cv::Size result(w, h);
-        return result;
+    // Keep only the tracks whose status is true, in order.
+    //
+    void compact(void) {
+        const size_t count = size();
+        size_t n = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (status[i]) {
+                points[n] = points[i];
+                ids[n] = ids[i];
+                error[n] = error[i];
+                status[n] = true;
+                ++n;
+            }
+        }
+        resize(n);
+    }
+};
+
+
+// A grid of square cells over a frame, counting the tracks in each cell,
+// so new points can be found only where there are none.
+//
+class OccupancyGrid {
+
+    int cellSize;                       // the width and height of a cell
+    cv::Size frameSize;                 // the size of the frame gridded
+    cv::Size gridSize;                  // columns and rows of cells
+    std::vector<int> counts;            // the tracks in each cell
+    int occupied;                       // the cells with tracks
+
+public:
+
+    // The fraction of cells with tracks.
+    //
+    double coverage(void) const {
+        return counts.empty() ? 0.0 : double(occupied) / counts.size();
+    }
+
+    int getCellCount(void) const { return counts.size(); }
+
+    // Grid a frame of size s into enough cells that each would hold about
+    // 4 of count points, but no smaller than 25 pixels on a side.
+    //
+    void reset(const cv::Size &s, int count) {
+        static const int perCell = 4;
+        static const int minCell = 25;
+        const double area = double(s.area()) * perCell / std::max(1, count);
+        cellSize = std::max(minCell, int(std::sqrt(area)));
+        frameSize = s;
+        gridSize.width = (s.width + cellSize - 1) / cellSize;
+        gridSize.height = (s.height + cellSize - 1) / cellSize;
+        counts.assign(gridSize.area(), 0);
+        occupied = 0;
+    }
+
+    // Count points in their cells, ignoring any outside the frame.
+    //
+    void count(const std::vector<cv::Point2f> &points) {
+        std::fill(counts.begin(), counts.end(), 0);
+        occupied = 0;
+        const int n = points.size();
+        for (int i = 0; i < n; ++i) {
+            const int x = points[i].x, y = points[i].y;
+            if (points[i].x < 0 || x >= frameSize.width) continue;
+            if (points[i].y < 0 || y >= frameSize.height) continue;
+            const int cell = y / cellSize * gridSize.width + x / cellSize;
+            if (0 == counts[cell]++) ++occupied;
+        }
     }
 
-    int getPosition(void) const {
-        CvVideoCapture *const p = const_cast<CvVideoCapture *>(this);
-        return p->get(cv::CAP_PROP_POS_FRAMES);
+    // Return the rectangles of the cells without tracks.
+    //
+    std::vector<cv::Rect> emptyCells(void) const {
+        std::vector<cv::Rect> result;
+        const cv::Rect frame(0, 0, frameSize.width, frameSize.height);
+        for (int r = 0; r < gridSize.height; ++r) {
+            for (int c = 0; c < gridSize.width; ++c) {
+                if (counts[r * gridSize.width + c]) continue;
+                const cv::Rect cell(c * cellSize, r * cellSize,
+                                    cellSize, cellSize);
+                result.push_back(cell & frame);
+            }
+        }
+        return result;
     }
-    void setPosition(int p) { this->set(cv::CAP_PROP_POS_FRAMES, p); }
 
-    CvVideoCapture(const std::string &fileName): VideoCapture(fileName) {}
-    CvVideoCapture(int n): VideoCapture(n) {}
-    CvVideoCapture(): VideoCapture() {}
+    OccupancyGrid(): cellSize(0), occupied(0) {}
 };
 
 
@@ -121,7 +298,14 @@ class LucasKanadeVideoPlayer {
     cv::Mat frame;                      // buffer of current frame from video
     cv::Mat priorGray;                  // prior frame in grayscale
     cv::Mat gray;                       // current frame in grayscale
-    bool night;                         // true for no backing video in image
+    std::vector<cv::Mat> priorPyramid;  // optical flow pyramid of priorGray
+    std::vector<cv::Mat> pyramid;       // optical flow pyramid of gray
+    std::atomic<bool> night;            // true for no backing video in image
+    bool headless;                      // true for no windows
+    int pointCount;                     // the most points to track
+    int nextId;                         // the id of the next new track
+    std::atomic<bool> replenish;        // true to replace lost points
+    OccupancyGrid grid;                 // where the tracks are in gray
 
     // NONE  means no user hot-key request is pending
     // POINT means newPoint contains a new tracking point from mouse
@@ -130,9 +314,11 @@ class LucasKanadeVideoPlayer {
     //
     enum Mode { NONE, POINT, CLEAR, TRACK } mode;
 
-    cv::Point2f newPoint;                 // new point from mouse
-    std::vector<cv::Point2f> priorPoints; // tracking points in priorGray
-    std::vector<cv::Point2f> points;      // tracking points in gray
+    cv::Point2f newPoint;               // new point from mouse
+    std::mutex modeMutex;               // guards mode and newPoint
+    Tracks priorTracks;                 // tracking points in priorGray
+    Tracks tracks;                      // tracking points in gray
+    Tracks backTracks;                  // tracks flowed back to priorGray
 
 
     // Draw a filled green circle of radius 3 on image at center.
@@ -152,18 +338,20 @@ class LucasKanadeVideoPlayer {
     {
         LucasKanadeVideoPlayer *const pV = (LucasKanadeVideoPlayer *)p;
         if (event == cv::EVENT_LBUTTONDOWN) {
+            std::lock_guard<std::mutex> lock(pV->modeMutex);
             pV->newPoint = cv::Point2f(x, y);
             pV->mode = LucasKanadeVideoPlayer::POINT;
         }
     }
 
-    // Return up to count good tracking points in gray.
+    // Return up to count good corners in gray to the nearest pixel, at
+    // least 10 pixels apart unless that is too far apart for count points.
     //
-    static std::vector<cv::Point2f>
-    getGoodTrackingPoints(int count, const cv::Mat &gray)
+    static std::vector<cv::Point2f> findCorners(int count, const cv::Mat &gray)
     {
         static const double quality = 0.01;
-        static const double minDistance = 10;
+        const double spacing = std::sqrt(double(gray.total()) / count) / 2;
+        const double minDistance = std::max(1.0, std::min(10.0, spacing));
         static const cv::Mat noMask;
         static const int blockSize = 3;
         static const bool useHarrisDetector = false;
@@ -171,61 +359,153 @@ class LucasKanadeVideoPlayer {
         std::vector<cv::Point2f> result;
         cv::goodFeaturesToTrack(gray, result, count, quality, minDistance,
                                 noMask, blockSize, useHarrisDetector, k);
+        return result;
+    }
+
+    // Refine the corners of gray in points to subpixel accuracy.  Pass the
+    // whole frame as gray, since cornerSubPix() needs an image at least
+    // 25 pixels on a side.
+    //
+    static void refineCorners(const cv::Mat &gray,
+                              std::vector<cv::Point2f> &points)
+    {
         static const cv::Size winSize(10, 10);
         static const cv::Size noZeroZone(-1, -1);
         static const cv::TermCriteria termCrit = makeTerminationCriteria();
-        cv::cornerSubPix(gray, result, winSize, noZeroZone, termCrit);
-        return result;
+        if (points.empty()) return;
+        cv::cornerSubPix(gray, points, winSize, noZeroZone, termCrit);
     }
 
-    // Calculate the flow of priorPoints in priorGray into points in gray.
-    // For points[i], result[i] is true iff it was in priorPoints[i] and
-    // its flow was tracked from priorGray to gray.
+    // Return up to count good tracking points in gray.
     //
-    static std::vector<uchar>
-    calcFlow(const cv::Mat &priorGray,
-             const std::vector<cv::Point2f> &priorPoints,
-             const cv::Mat &gray,
-             std::vector<cv::Point2f> &points)
+    static std::vector<cv::Point2f>
+    getGoodTrackingPoints(int count, const cv::Mat &gray)
     {
-        static const cv::Size winSize(31, 31);
-        static const int level = 3;
-        static const cv::TermCriteria termCrit = makeTerminationCriteria();
-        static const int flags = 0;
-        static const double eigenThreshold = 0.001;
-        std::vector<uchar> result;
-        std::vector<float> error;
-        if (priorGray.empty()) gray.copyTo(priorGray);
-        cv::calcOpticalFlowPyrLK(priorGray, gray, priorPoints, points,
-                                 result, error, winSize, level,
-                                 termCrit, flags, eigenThreshold);
+        std::vector<cv::Point2f> result = findCorners(count, gray);
+        refineCorners(gray, result);
         return result;
     }
 
-    // Draw on image each point from points whose status is true and return
-    // all the points drawn.
+    // The search window and the number of levels above the frame in the
+    // optical flow pyramids.
     //
-    static std::vector<cv::Point2f>
-    drawPoints(cv::Mat &image,
-               const std::vector<uchar> &status,
-               const std::vector<cv::Point2f> &points)
+    static cv::Size flowWinSize(void) { return cv::Size(31, 31); }
+    enum { flowLevel = 3 };
+
+    // Build into pyramid the optical flow pyramid of gray, with the
+    // derivatives calcFlow() needs when it becomes the prior pyramid.
+    // Reuse the levels already in pyramid.
+    //
+    static void buildPyramid(const cv::Mat &gray,
+                             std::vector<cv::Mat> &pyramid)
     {
-        std::vector<cv::Point2f> result;
-        const int count = points.size();
-        for (int i = 0; i < count; ++i) {
-            if (status[i]) {
-                const cv::Point2f point = points[i];
-                result.push_back(point);
-                drawGreenCircle(image, point);
+        static const bool withDerivatives = true;
+        static const int pyrBorder = cv::BORDER_REFLECT_101;
+        static const int derivBorder = cv::BORDER_CONSTANT;
+        static const bool tryReuseInputImage = true;
+        cv::buildOpticalFlowPyramid(gray, pyramid, flowWinSize(), flowLevel,
+                                    withDerivatives, pyrBorder, derivBorder,
+                                    tryReuseInputImage);
+    }
+
+    // Track shards of shardSize prior tracks from priorPyramid into
+    // tracks in pyramid.  Each shard reads and writes only its own range
+    // of the arrays in the Tracks, through Mat headers, so the shards
+    // share nothing but the pyramids they read.
+    //
+    struct FlowShards: cv::ParallelLoopBody {
+        const std::vector<cv::Mat> &priorPyramid;
+        const Tracks &prior;
+        const std::vector<cv::Mat> &pyramid;
+        Tracks &tracks;
+        const int shardSize;
+        void operator()(const cv::Range &range) const {
+            static const cv::TermCriteria termCrit
+                = makeTerminationCriteria();
+            static const int flags = 0;
+            static const double eigenThreshold = 0.001;
+            const int count = prior.size();
+            for (int s = range.start; s < range.end; ++s) {
+                const int begin = s * shardSize;
+                const int n = std::min(count - begin, shardSize);
+                void *const from = (void *)&prior.points[begin];
+                cv::Mat priorPoints(n, 1, CV_32FC2, from);
+                cv::Mat points(n, 1, CV_32FC2, &tracks.points[begin]);
+                cv::Mat status(n, 1, CV_8U, &tracks.status[begin]);
+                cv::Mat error(n, 1, CV_32F, &tracks.error[begin]);
+                cv::calcOpticalFlowPyrLK(priorPyramid, pyramid,
+                                         priorPoints, points,
+                                         status, error,
+                                         flowWinSize(), flowLevel,
+                                         termCrit, flags, eigenThreshold);
             }
         }
-        return result;
+        FlowShards(const std::vector<cv::Mat> &pp, const Tracks &p,
+                   const std::vector<cv::Mat> &py, Tracks &t, int n):
+            priorPyramid(pp), prior(p), pyramid(py), tracks(t), shardSize(n)
+        {}
+    };
+
+    // Flow the prior tracks in priorPyramid into tracks in pyramid, in
+    // shards of up to 1024 points on separate threads.  Copy the ids of
+    // prior into tracks, and leave status false where flow was lost.
+    //
+    static void flowShards(const std::vector<cv::Mat> &priorPyramid,
+                           const Tracks &prior,
+                           const std::vector<cv::Mat> &pyramid,
+                           Tracks &tracks)
+    {
+        static const int shardSize = 1024;
+        const int count = prior.size();
+        const int shardCount = (count + shardSize - 1) / shardSize;
+        tracks.resize(count);
+        std::copy(prior.ids.begin(), prior.ids.end(), tracks.ids.begin());
+        cv::parallel_for_(cv::Range(0, shardCount),
+                          FlowShards(priorPyramid, prior, pyramid, tracks,
+                                     shardSize));
+    }
+
+    // Calculate the flow of priorTracks in priorPyramid into tracks in
+    // pyramid, and compact away the tracks whose flow was lost.
+    //
+    // When replenishing, also flow tracks back into priorPyramid, and lose
+    // any track that does not land back within a pixel of where it
+    // started.  That drops the drifting points on weak corners that
+    // replenishment keeps adding.
+    //
+    void calcFlow(void)
+    {
+        static const float maxBackError = 1.0f;
+        const std::vector<cv::Mat> &from
+            = priorPyramid.empty() ? pyramid : priorPyramid;
+        flowShards(from, priorTracks, pyramid, tracks);
+        if (replenish) {
+            flowShards(pyramid, tracks, from, backTracks);
+            const int count = tracks.size();
+            for (int i = 0; i < count; ++i) {
+                const cv::Point2f d
+                    = backTracks.points[i] - priorTracks.points[i];
+                const bool back = backTracks.status[i]
+                    && d.dot(d) <= maxBackError * maxBackError;
+                tracks.status[i] = tracks.status[i] && back;
+            }
+        }
+        tracks.compact();
+    }
+
+    // Draw each of points on image.
+    //
+    static void drawPoints(cv::Mat &image,
+                           const std::vector<cv::Point2f> &points)
+    {
+        const int count = points.size();
+        for (int i = 0; i < count; ++i) drawGreenCircle(image, points[i]);
     }
 
-    // Add newPoint to points, after adjusting it to the nearest good
-    // corner in gray.  Return the adjusted new point.
+    // Add newPoint to tracks as id, after adjusting it to the nearest
+    // good corner in gray.  Return the adjusted new point.
     //
-    static cv::Point2f addTrackingPoint(std::vector<cv::Point2f> &points,
+    static cv::Point2f addTrackingPoint(Tracks &tracks, int id,
                                         const cv::Mat &gray,
                                         const cv::Point2f newPoint)
     {
@@ -236,37 +516,96 @@ class LucasKanadeVideoPlayer {
         vnp.push_back(newPoint);
         cv::cornerSubPix(gray, vnp, winSize, noZeroZone, termCrit);
         const cv::Point2f result = vnp[0];
-        points.push_back(result);
+        tracks.add(result, id);
         return result;
     }
 
+    // Replace tracks with up to pointCount new ones at good tracking
+    // points in gray.
+    //
+    void seedTracks(void)
+    {
+        const std::vector<cv::Point2f> points
+            = getGoodTrackingPoints(pointCount, gray);
+        tracks.clear();
+        for (size_t i = 0; i < points.size(); ++i) {
+            tracks.add(points[i], nextId++);
+        }
+    }
+
+    // Add tracks at good tracking points in the empty cells of grid, when
+    // fewer than 90% of its cells have tracks, up to pointCount tracks in
+    // all.  Find the corners in each empty cell separately, so the cost of
+    // finding them is in proportion to the empty area of the frame, then
+    // refine them all at once in the whole frame.
+    //
+    void replenishTracks(void)
+    {
+        static const double minCoverage = 0.9;
+        if (grid.getCellCount() == 0) grid.reset(gray.size(), pointCount);
+        grid.count(tracks.points);
+        if (grid.coverage() >= minCoverage) return;
+        const std::vector<cv::Rect> cells = grid.emptyCells();
+        const int perCell = std::max(1, pointCount / grid.getCellCount());
+        const int count = cells.size();
+        int room = pointCount - int(tracks.size());
+        std::vector<cv::Point2f> found;
+        for (int i = 0; room > 0 && i < count; ++i) {
+            const cv::Rect &cell = cells[i];
+            const cv::Point2f offset = cell.tl();
+            const std::vector<cv::Point2f> corners
+                = findCorners(std::min(room, perCell), gray(cell));
+            for (size_t j = 0; j < corners.size(); ++j) {
+                found.push_back(corners[j] + offset);
+            }
+            room -= corners.size();
+        }
+        refineCorners(gray, found);
+        for (size_t i = 0; i < found.size(); ++i) {
+            tracks.add(found[i], nextId++);
+        }
+    }
+
     // Adjust image for night and mode settings, then track and draw points
-    // on image.
+    // on image.  Take the pending mode and newPoint under modeMutex, since
+    // the keys and mouse may set them from another thread.
     //
     void handleModes(void)
     {
-        static const int count = 500;
+        Mode pending;
+        cv::Point2f point;
+        {
+            std::lock_guard<std::mutex> lock(modeMutex);
+            pending = mode;
+            point = newPoint;
+            mode = NONE;
+        }
         if (night) image = cv::Scalar::all(0);
-        if (mode == CLEAR) {
-            priorPoints.clear();
-            points.clear();
-        } else if (mode == TRACK) {
-            points = getGoodTrackingPoints(count, gray);
-        } else if (!priorPoints.empty()) {
-            const std::vector<uchar> status
-                = calcFlow(priorGray, priorPoints, gray, points);
-            points = drawPoints(image, status, points);
+        if (pending == CLEAR) {
+            priorTracks.clear();
+            tracks.clear();
+        } else if (pending == TRACK) {
+            seedTracks();
+        } else if (!priorTracks.empty()) {
+            calcFlow();
+        } else {
+            tracks.clear();
         }
-        if (mode == POINT && points.size() < count) {
-            const cv::Point2f p = addTrackingPoint(points, gray, newPoint);
+        if (replenish && pending != CLEAR) replenishTracks();
+        drawPoints(image, tracks.points);
+        if (pending == POINT && int(tracks.size()) < pointCount) {
+            const cv::Point2f p
+                = addTrackingPoint(tracks, nextId++, gray, point);
             drawGreenCircle(image, p);
         }
-        mode = NONE;
     }
 
     // Show the frame at position updating trackbar state as necessary.
     // Handle any mode set by hot-key and save prior state for later use.
     //
+    // Each frame's pyramid is built once here and kept as the prior
+    // pyramid for the next frame, so calcFlow() never rebuilds it.
+    //
     void showFrame(void) {
         video >> frame;
         if (frame.data) {
@@ -275,16 +614,102 @@ class LucasKanadeVideoPlayer {
                 cv::setTrackbarPos("Position", title, position);
             }
             cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+            buildPyramid(gray, pyramid);
             frame.copyTo(image);
             handleModes();
-            std::swap(priorPoints, points);
+            std::swap(priorTracks, tracks);
             std::swap(priorGray, gray);
+            std::swap(priorPyramid, pyramid);
             cv::imshow(title, image);
         } else {
             state = STEP;
         }
     }
 
+    // Handle the hot-key c.  Return false to quit.
+    //
+    bool handleKey(char c)
+    {
+        std::lock_guard<std::mutex> lock(modeMutex);
+        switch (c) {
+        case 'q': case 'Q': return false;
+        case 'n': case 'N': night = !night; break;
+        case 'a': case 'A': replenish = !replenish; break;
+        case 't': case 'T': mode  = TRACK;  break;
+        case 'c': case 'C': mode  = CLEAR;  break;
+        case 'r': case 'R': state = RUN;    break;
+        case 's': case 'S': state = STEP;   break;
+        }
+        return true;
+    }
+
+    // The newest tracked image of a live video, handed from the tracking
+    // thread to the display.
+    //
+    struct Latest {
+        std::mutex mutex;               // guards all of the below
+        std::condition_variable ready;  // image is fresh or done
+        cv::Mat image;                  // the newest tracked image
+        int64 tick;                     // when the frame of image was read
+        bool fresh;                     // true if image is not shown yet
+        bool done;                      // true when tracking stops
+        bool stop;                      // true to stop tracking
+        int dropCount;                  // images replaced before shown
+        Latest(): tick(0), fresh(false), done(false), stop(false),
+                  dropCount(0) {}
+    };
+
+    // Track each frame of video into image, and hand it to latest,
+    // replacing any image not yet shown, until the video ends or until
+    // latest.stop.  This runs on its own thread.
+    //
+    void trackLive(Latest &latest)
+    {
+        int64 tick;
+        while (video.read(frame, tick)) {
+            cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+            buildPyramid(gray, pyramid);
+            frame.copyTo(image);
+            handleModes();
+            std::swap(priorTracks, tracks);
+            std::swap(priorGray, gray);
+            std::swap(priorPyramid, pyramid);
+            std::lock_guard<std::mutex> lock(latest.mutex);
+            if (latest.stop) break;
+            if (latest.fresh) ++latest.dropCount;
+            std::swap(latest.image, image);
+            latest.tick = tick;
+            latest.fresh = true;
+            latest.ready.notify_one();
+        }
+        std::lock_guard<std::mutex> lock(latest.mutex);
+        latest.done = true;
+        latest.ready.notify_one();
+    }
+
+    // Show on os the frames shown and dropped, and the mean, median, 99th
+    // percentile and worst latency in ms from reading a frame to showing
+    // it.
+    //
+    void reportLive(std::ostream &os, const Latest &latest,
+                    std::vector<double> &ms) const
+    {
+        const int captureDrops = video.getDropCount();
+        os << ms.size() << " frames shown, " << captureDrops
+           << " dropped by capture, " << latest.dropCount
+           << " dropped by display." << std::endl;
+        if (ms.empty()) return;
+        std::sort(ms.begin(), ms.end());
+        double total = 0.0;
+        for (size_t i = 0; i < ms.size(); ++i) total += ms[i];
+        const size_t p99 = std::min(ms.size() - 1, ms.size() * 99 / 100);
+        os << std::setiosflags(std::ios::fixed) << std::setprecision(3)
+           << "latency mean " << total / ms.size()
+           << "  median " << ms[ms.size() / 2]
+           << "  p99 " << ms[p99]
+           << "  max " << ms.back() << " ms" << std::endl;
+    }
+
     // This is the trackbar callback where p is this LucasKanadeVideoPlayer.
     //
     static void onTrackBar(int position, void *p)
@@ -310,7 +735,16 @@ class LucasKanadeVideoPlayer {
 
 public:
 
-    ~LucasKanadeVideoPlayer() { cv::destroyWindow(title); }
+    enum Display { WINDOW, HEADLESS };
+
+    // Track up to count points.
+    //
+    void setPointCount(int count) {
+        pointCount = std::max(1, count);
+        grid = OccupancyGrid();
+    }
+
+    ~LucasKanadeVideoPlayer() { if (!headless) cv::destroyWindow(title); }
 
     // True if this can play.
     //
@@ -323,27 +757,95 @@ public:
         while (*this) {
             showFrame();
             const int wait = state == RUN ? msDelay : 0;
-            const char c = cv::waitKey(wait);
-            switch (c) {
-            case 'q': case 'Q': return true;
-            case 'n': case 'N': night = !night; break;
-            case 't': case 'T': mode  = TRACK;  break;
-            case 'c': case 'C': mode  = CLEAR;  break;
-            case 'r': case 'R': state = RUN;    break;
-            case 's': case 'S': state = STEP;   break;
-            }
+            if (!handleKey(cv::waitKey(wait))) return true;
         }
         return false;
     }
 
-    // Run Lukas-Kanade tracking on video from file t.
+    // Track a live video on another thread while showing only the newest
+    // tracked image here, so a slow frame is dropped instead of delaying
+    // every frame after it.  The capture keeps only its newest frame too.
+    // Report the latency from capture to display and the frames dropped
+    // on os.  Return true unless something goes wrong.
     //
-    LucasKanadeVideoPlayer(const char *t):
+    bool live(std::ostream &os) {
+        static const std::chrono::milliseconds poll(10);
+        Latest latest;
+        std::vector<double> ms;
+        cv::Mat shown;
+        std::thread tracker(&LucasKanadeVideoPlayer::trackLive, this,
+                            std::ref(latest));
+        bool quit = false;
+        while (!quit) {
+            int64 tick = 0;
+            {
+                std::unique_lock<std::mutex> lock(latest.mutex);
+                latest.ready.wait_for(lock, poll, [&latest]{
+                    return latest.fresh || latest.done;
+                });
+                if (latest.done && !latest.fresh) break;
+                if (latest.fresh) {
+                    std::swap(shown, latest.image);
+                    tick = latest.tick;
+                    latest.fresh = false;
+                }
+            }
+            if (tick) {
+                cv::imshow(title, shown);
+                ms.push_back((cv::getTickCount() - tick) * 1000.0
+                             / cv::getTickFrequency());
+            }
+            quit = !handleKey(cv::waitKey(1));
+        }
+        {
+            std::lock_guard<std::mutex> lock(latest.mutex);
+            latest.stop = true;
+        }
+        tracker.join();
+        reportLive(os, latest, ms);
+        return quit;
+    }
+
+    // Track points through the whole video without windows, and write
+    // the points tracked in each frame to the file named fileName.
+    // Replenish the points as they are lost.  Show frames per second on
+    // os.  Return true unless something goes wrong.
+    //
+    bool exportTracks(const char *fileName, std::ostream &os) {
+        TrajectoryWriter writer(fileName);
+        replenish = true;
+        int frameNumber = 0;
+        const int64 tickZero = cv::getTickCount();
+        for (; writer && video.read(frame); ++frameNumber) {
+            cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+            buildPyramid(gray, pyramid);
+            tracks.clear();
+            if (!priorTracks.empty()) calcFlow();
+            replenishTracks();
+            writer.write(frameNumber, tracks.ids, tracks.points);
+            std::swap(priorTracks, tracks);
+            std::swap(priorGray, gray);
+            std::swap(priorPyramid, pyramid);
+        }
+        const double seconds
+            = (cv::getTickCount() - tickZero) / cv::getTickFrequency();
+        os << frameNumber << " frames in " << seconds << " seconds: "
+           << frameNumber / seconds << " frames/second with " << nextId
+           << " tracks." << std::endl;
+        return writer;
+    }
+
+    // Run Lukas-Kanade tracking on video from file t, in a window unless
+    // d is HEADLESS.
+    //
+    LucasKanadeVideoPlayer(const char *t, Display d = WINDOW):
         video(t), title(t), msDelay(1000 / video.getFramesPerSecond()),
         frameCount(video.getFrameCount()),
-        position(0), state(STEP), night(false)
+        position(0), state(STEP), night(false), headless(d == HEADLESS),
+        pointCount(500), nextId(0),
+        replenish(false)
     {
-        if (*this) {
+        if (*this && !headless) {
             cv::namedWindow(title, cv::WINDOW_AUTOSIZE);
             cv::setMouseCallback(title, &onMouseClick, this);
             cv::createTrackbar("Position", title, &position, frameCount,
@@ -351,11 +853,14 @@ public:
         }
     }
 
-    // Run Lukas-Kanade tracking on video from camera n.
+    // Run Lukas-Kanade tracking on video from camera n, keeping only the
+    // newest frame captured.
     //
     LucasKanadeVideoPlayer(int n):
-        video(n), title("Camera "), msDelay(1000 / video.getFramesPerSecond()),
-        frameCount(0), position(0), state(RUN), night(false)
+        video(n, 1), title("Camera "),
+        msDelay(1000 / video.getFramesPerSecond()), frameCount(0),
+        position(0), state(RUN), night(false), headless(false),
+        pointCount(500), nextId(0), replenish(false)
     {
         if (*this) {
             title += std::to_string(n);
@@ -366,16 +871,43 @@ public:
 };
 
 
+// Remove --points <count> from the ac arguments in av, and return count
+// or 500 if it is not there.
+//
+static int takePointCount(int &ac, const char *av[])
+{
+    int result = 500;
+    int out = 0;
+    for (int in = 0; in < ac; ++in) {
+        if (0 == strcmp(av[in], "--points") && in + 1 < ac) {
+            result = atoi(av[++in]);
+        } else {
+            av[out++] = av[in];
+        }
+    }
+    ac = out;
+    return result;
+}
+
 int main(int ac, const char *av[])
 {
+    const int pointCount = takePointCount(ac, av);
+    if (ac == 4 && 0 == strcmp(av[2], "--export")) {
+        LucasKanadeVideoPlayer video(av[1], LucasKanadeVideoPlayer::HEADLESS);
+        video.setPointCount(pointCount);
+        if (video) std::cout << video << std::endl;
+        if (video && video.exportTracks(av[3], std::cout)) return 0;
+    }
     if (ac == 2) {
         if (0 == strcmp(av[1], "-")) {
             LucasKanadeVideoPlayer camera(-1);
+            camera.setPointCount(pointCount);
             if (camera) showKeys(std::cout, av[0]);
             if (camera) std::cout << camera << std::endl;
-            if (camera()) return 0;
+            if (camera.live(std::cout)) return 0;
         } else {
             LucasKanadeVideoPlayer video(av[1]);
+            video.setPointCount(pointCount);
             if (video) showKeys(std::cout, av[0]);
             if (video) std::cout << video << std::endl;
             if (video()) return 0;
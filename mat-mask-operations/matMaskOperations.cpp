@@ -1,8 +1,15 @@
 #include <opencv2/core/utility.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <cmath>
+#include <cstring>
 #include <iostream>
 
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "benchmark.hpp"
 
 // Show a usage message on cout for program named av0.
 //
@@ -12,12 +19,17 @@ static void showUsage(const char *av0)
         << av0 << ": Filter an image with a 'sharpening' mask."
         << std::endl << std::endl
         << "Usage: " << av0 << " <image-file> [g]"
+        << " [--csv <file> | --json <file>]"
         << std::endl << std::endl
         << "Where: <image-file> is the path to an image file."
         << std::endl
         << "       The image should have a Mat::depth() of CV_8U."
         << std::endl
         << "       g means process the image in gray scale."
+        << std::endl
+        << "       --csv or --json writes every timing to <file>"
+        << std::endl
+        << "              without showing any windows."
         << std::endl << std::endl
         << "Example: " << av0 << " ../resources/lena.tiff"
         << std::endl
@@ -34,6 +46,7 @@ static void showUsage(const char *av0)
 //
 static void makeWindow(const char *window, const cv::Mat &image, int reset = 0)
 {
+    if (bench::batch()) return;
     static int across = 1;
     static int count, moveX, moveY, maxY = 0;
     if (reset) {
@@ -97,6 +110,8 @@ struct Filter2dTest: Test {
         return result;
     }
     Filter2dTest(const cv::Mat &i): Test("filter2D()", i), mask(makeMask()) {}
+    Filter2dTest(const char *l, const cv::Mat &i, const cv::Mat &m):
+        Test(l, i), mask(m) {}
 };
 
 // Do what Filter2dTest does via a hand-coded scanner.
@@ -121,6 +136,11 @@ struct HandCodedTest: Test {
                 *p++ = cv::saturate_cast<uchar>(sharper);
             }
         }
+        maskBorder(output);
+    }
+    static void maskBorder(cv::Mat &output) {
+        const int rowMax = output.rows - 1;
+        const int colMax = output.cols - 1;
         static const cv::Scalar zero(0);        // Mask the border to 0.
         output.row(0).setTo(zero);              // Set first row to 0.
         output.row(rowMax).setTo(zero);         // Set last  row to 0.
@@ -130,27 +150,417 @@ struct HandCodedTest: Test {
     HandCodedTest(const cv::Mat &i): Test("hand-coded", i) {}
 };
 
+// Do what HandCodedTest does 32 (AVX2) or 16 (SSE2) bytes at a time.
+//
+// Widen each byte of the 5 neighborhoods to 16 bits so 5 * c - n - s -
+// e - w cannot overflow, then pack the sums back to bytes with unsigned
+// saturation -- which is what saturate_cast<uchar>() does to one sum.
+// Unpacking and packing work within 128-bit lanes, so the bytes come
+// back out in the order they went in.  Bytes left over at the end of a
+// row go through the same scalar code as HandCodedTest.
+//
+struct SimdTest: Test {
+    void operator()(void) {
+        const int nChannels = input.channels();
+        const int rowMax = input.rows - 1;
+        const int iMax = nChannels * (input.cols - 1);
+        for (int j = 1 ; j < rowMax; ++j) {
+            sharpenRow(input.ptr<uchar>(j - 1),
+                       input.ptr<uchar>(j    ),
+                       input.ptr<uchar>(j + 1),
+                       output.ptr<uchar>(j), nChannels, iMax, nChannels);
+        }
+        HandCodedTest::maskBorder(output);
+    }
+
+    // Sharpen bytes [i, iMax) of the row current into p, where previous
+    // and next are the rows above and below current.
+    //
+    static void sharpenRow(const uchar *previous, const uchar *current,
+                           const uchar *next, uchar *p,
+                           int i, int iMax, int nChannels) {
+#if defined(__AVX2__)
+        const __m256i zero = _mm256_setzero_si256();
+        for (; i + 32 <= iMax; i += 32) {
+            const __m256i n = load32(previous + i);
+            const __m256i w = load32(current + i - nChannels);
+            const __m256i c = load32(current + i);
+            const __m256i e = load32(current + i + nChannels);
+            const __m256i s = load32(next + i);
+            const __m256i lo = sharpen(
+                _mm256_unpacklo_epi8(n, zero),
+                _mm256_unpacklo_epi8(w, zero),
+                _mm256_unpacklo_epi8(c, zero),
+                _mm256_unpacklo_epi8(e, zero),
+                _mm256_unpacklo_epi8(s, zero));
+            const __m256i hi = sharpen(
+                _mm256_unpackhi_epi8(n, zero),
+                _mm256_unpackhi_epi8(w, zero),
+                _mm256_unpackhi_epi8(c, zero),
+                _mm256_unpackhi_epi8(e, zero),
+                _mm256_unpackhi_epi8(s, zero));
+            const __m256i sharper = _mm256_packus_epi16(lo, hi);
+            _mm256_storeu_si256((__m256i *)(p + i), sharper);
+        }
+#elif defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= iMax; i += 16) {
+            const __m128i n = load16(previous + i);
+            const __m128i w = load16(current + i - nChannels);
+            const __m128i c = load16(current + i);
+            const __m128i e = load16(current + i + nChannels);
+            const __m128i s = load16(next + i);
+            const __m128i lo = sharpen(
+                _mm_unpacklo_epi8(n, zero),
+                _mm_unpacklo_epi8(w, zero),
+                _mm_unpacklo_epi8(c, zero),
+                _mm_unpacklo_epi8(e, zero),
+                _mm_unpacklo_epi8(s, zero));
+            const __m128i hi = sharpen(
+                _mm_unpackhi_epi8(n, zero),
+                _mm_unpackhi_epi8(w, zero),
+                _mm_unpackhi_epi8(c, zero),
+                _mm_unpackhi_epi8(e, zero),
+                _mm_unpackhi_epi8(s, zero));
+            const __m128i sharper = _mm_packus_epi16(lo, hi);
+            _mm_storeu_si128((__m128i *)(p + i), sharper);
+        }
+#endif
+        for (; i < iMax; ++i) {
+            const int sharper = 5 * current[i]
+                - previous[i] - current[i - nChannels]
+                - current[i + nChannels] - next[i];
+            p[i] = cv::saturate_cast<uchar>(sharper);
+        }
+    }
+#if defined(__AVX2__)
+    static __m256i load32(const uchar *p) {
+        return _mm256_loadu_si256((const __m256i *)p);
+    }
+    static __m256i sharpen(__m256i n, __m256i w, __m256i c,
+                           __m256i e, __m256i s) {
+        const __m256i c5 = _mm256_add_epi16(_mm256_slli_epi16(c, 2), c);
+        const __m256i ns = _mm256_add_epi16(n, s);
+        const __m256i we = _mm256_add_epi16(w, e);
+        return _mm256_sub_epi16(c5, _mm256_add_epi16(ns, we));
+    }
+#elif defined(__SSE2__)
+    static __m128i load16(const uchar *p) {
+        return _mm_loadu_si128((const __m128i *)p);
+    }
+    static __m128i sharpen(__m128i n, __m128i w, __m128i c,
+                           __m128i e, __m128i s) {
+        const __m128i c5 = _mm_add_epi16(_mm_slli_epi16(c, 2), c);
+        const __m128i ns = _mm_add_epi16(n, s);
+        const __m128i we = _mm_add_epi16(w, e);
+        return _mm_sub_epi16(c5, _mm_add_epi16(ns, we));
+    }
+#endif
+    SimdTest(const cv::Mat &i): Test("SIMD      ", i) {}
+};
+
+// Do what SimdTest does in tiles spread across threads, and write the
+// border in the same pass instead of with four setTo() calls after it.
+//
+// A tile is tileRows rows of as many bytes as fit the tile's input rows,
+// the rows just above and below them, and its output rows together in a
+// typical 256 KB L2 cache.  cv::parallel_for_() hands the tiles out to
+// its threads.  A tile on the image border zeroes its part of the first
+// or last row, or the first or last pixel of each of its rows, so no
+// pass ever walks down a column of output.
+//
+struct TiledTest: Test {
+    enum { cacheBytes = 256 * 1024, tileRows = 32 };
+    const int rowBytes;                 // bytes in a row of input
+    const int tileBytes;                // bytes in a row of a tile
+    const int tilesAcross;              // tiles in a row of tiles
+    const int tilesDown;                // rows of tiles
+
+    struct Tiles: cv::ParallelLoopBody {
+        const TiledTest &t;
+        cv::Mat &output;
+        void operator()(const cv::Range &tiles) const {
+            const int nChannels = t.input.channels();
+            const int rowMax = t.input.rows - 1;
+            const int iMax = t.rowBytes - nChannels;
+            for (int k = tiles.start; k < tiles.end; ++k) {
+                const int j0 = k / t.tilesAcross * tileRows;
+                const int jN = std::min(j0 + tileRows, t.input.rows);
+                const int i0 = k % t.tilesAcross * t.tileBytes;
+                const int iN = std::min(i0 + t.tileBytes, t.rowBytes);
+                const int begin = std::max(i0, nChannels);
+                const int end = std::min(iN, iMax);
+                for (int j = j0; j < jN; ++j) {
+                    uchar *const p = output.ptr<uchar>(j);
+                    if (j == 0 || j == rowMax) {
+                        std::memset(p + i0, 0, iN - i0);
+                        continue;
+                    }
+                    if (begin < end) {
+                        SimdTest::sharpenRow(t.input.ptr<uchar>(j - 1),
+                                             t.input.ptr<uchar>(j    ),
+                                             t.input.ptr<uchar>(j + 1),
+                                             p, begin, end, nChannels);
+                    }
+                    if (i0 == 0) std::memset(p, 0, nChannels);
+                    if (iN == t.rowBytes) std::memset(p + iMax, 0, nChannels);
+                }
+            }
+        }
+        Tiles(TiledTest &tt): t(tt), output(tt.output) {}
+    };
+
+    void operator()(void) {
+        const cv::Range tiles(0, tilesAcross * tilesDown);
+        cv::parallel_for_(tiles, Tiles(*this));
+    }
+
+    // Return the bytes in a row of a tile for rows of rowBytes bytes.
+    //
+    static int makeTileBytes(int rowBytes) {
+        static const int align = 64;
+        const int fit = cacheBytes / (2 * (tileRows + 2)) / align * align;
+        return std::min(rowBytes, std::max(align, fit));
+    }
+
+    TiledTest(const cv::Mat &i):
+        Test("tiled     ", i),
+        rowBytes(i.cols * i.channels()),
+        tileBytes(makeTileBytes(rowBytes)),
+        tilesAcross((rowBytes + tileBytes - 1) / tileBytes),
+        tilesDown((i.rows + tileRows - 1) / tileRows)
+    {}
+};
+
+// Kernels known at compile time, with weights applied to the size x size
+// neighborhood of a pixel in row-major order, and the sum of the weighted
+// neighborhood divided by divisor.
+//
+struct Sharpen {
+    enum { size = 3, divisor = 1 };
+    static constexpr int weights[size * size] = {
+        +0, -1, +0,
+        -1, +5, -1,
+        +0, -1, +0
+    };
+    static const char *name(void) { return "sharpen"; }
+};
+constexpr int Sharpen::weights[];
+
+struct Laplacian {
+    enum { size = 3, divisor = 1 };
+    static constexpr int weights[size * size] = {
+        +0, +1, +0,
+        +1, -4, +1,
+        +0, +1, +0
+    };
+    static const char *name(void) { return "laplacian"; }
+};
+constexpr int Laplacian::weights[];
+
+struct Box {
+    enum { size = 3, divisor = 9 };
+    static constexpr int weights[size * size] = {
+        +1, +1, +1,
+        +1, +1, +1,
+        +1, +1, +1
+    };
+    static const char *name(void) { return "box"; }
+};
+constexpr int Box::weights[];
+
+struct Emboss {
+    enum { size = 3, divisor = 1 };
+    static constexpr int weights[size * size] = {
+        -2, -1, +0,
+        -1, +1, +1,
+        +0, +1, +2
+    };
+    static const char *name(void) { return "emboss"; }
+};
+constexpr int Emboss::weights[];
+
+// Return Weight times the byte at p, or just 0 without reading p when
+// Weight is 0 -- so a zero tap costs nothing even in a debug build.
+//
+template <int Weight> struct Tap {
+    static int times(const uchar *p) { return Weight * *p; }
+};
+template <> struct Tap<0> {
+    static int times(const uchar *) { return 0; }
+};
+
+// Return the weighted sum of the neighborhood of byte i in the rows of
+// Kernel::size rows starting from tap Index of Kernel.
+//
+// Each Stencil<> adds one tap to the next Stencil<>, so the compiler
+// unrolls the whole kernel into a straight line of its non-zero taps.
+//
+template <typename Kernel, int Index = 0,
+          bool Done = Index == Kernel::size * Kernel::size>
+struct Stencil {
+    enum {
+        row = Index / Kernel::size,
+        col = Index % Kernel::size - Kernel::size / 2,
+        weight = Kernel::weights[Index]
+    };
+    static int sum(const uchar *const rows[], int i, int nChannels) {
+        const uchar *const p = rows[row] + i + col * nChannels;
+        return Tap<weight>::times(p)
+            + Stencil<Kernel, Index + 1>::sum(rows, i, nChannels);
+    }
+};
+template <typename Kernel, int Index>
+struct Stencil<Kernel, Index, true> {
+    static int sum(const uchar *const [], int, int) { return 0; }
+};
+
+// Do what Filter2dTest does with the mask of Kernel by unrolling Kernel
+// into hand-coded taps at compile time.  Round the sum to the nearest
+// integer after dividing by Kernel::divisor, as filter2D() does, and
+// mask the border as HandCodedTest does.
+//
+template <typename Kernel>
+struct StencilTest: Test {
+    enum { half = Kernel::size / 2, divisor = Kernel::divisor };
+    void operator()(void) {
+        const int nChannels = input.channels();
+        const int iMin = nChannels * half;
+        const int iMax = nChannels * (input.cols - half);
+        const uchar *rows[Kernel::size];
+        for (int j = half; j < input.rows - half; ++j) {
+            for (int k = 0; k < Kernel::size; ++k) {
+                rows[k] = input.ptr<uchar>(j - half + k);
+            }
+            uchar *const p = output.ptr<uchar>(j);
+            for (int i = iMin; i < iMax; ++i) {
+                const int sum = Stencil<Kernel>::sum(rows, i, nChannels);
+                p[i] = cv::saturate_cast<uchar>(divide(sum));
+            }
+        }
+        static const cv::Scalar zero(0);
+        output.rowRange(0, half).setTo(zero);
+        output.rowRange(input.rows - half, input.rows).setTo(zero);
+        output.colRange(0, half).setTo(zero);
+        output.colRange(input.cols - half, input.cols).setTo(zero);
+    }
+    static int divide(int sum) {
+        if (divisor == 1) return sum;
+        if (sum < 0) return -((divisor / 2 - sum) / divisor);
+        return (sum + divisor / 2) / divisor;
+    }
+
+    // Return a mask for filter2D() that does what Kernel does.
+    //
+    static cv::Mat makeMask(void) {
+        cv::Mat_<float> result(Kernel::size, Kernel::size);
+        for (int k = 0; k < Kernel::size * Kernel::size; ++k) {
+            result(k / Kernel::size, k % Kernel::size)
+                = Kernel::weights[k] / float(divisor);
+        }
+        return result;
+    }
+    StencilTest(const char *l, const cv::Mat &i): Test(l, i) {}
+};
+
+// Have harness time runCount runs of test as a case with params.
+//
+static void timeTest(bench::Harness &harness, Test &test, int runCount,
+                     const bench::Params &params = bench::Params())
+{
+    const cv::Mat &input = test.input;
+    const double pixels = input.total();
+    const double bytes = pixels * input.elemSize();
+    const bench::Params size = bench::Params()
+        .add("width", input.cols).add("height", input.rows);
+    harness.run(test.label, bench::Params().add(size).add(params),
+                runCount, pixels, bytes, [&] { test(); });
+}
+
+// Time runCount runs of StencilTest<Kernel> on input next to runCount
+// runs of filter2D() with the same mask.
+//
+template <typename Kernel>
+static void showStencil(bench::Harness &harness, const cv::Mat &input,
+                        int runCount)
+{
+    const std::string name(Kernel::name());
+    const std::string stencilLabel = name + "<>";
+    const std::string builtinLabel = "filter2D() " + name;
+    StencilTest<Kernel> stencilTest(stencilLabel.c_str(), input);
+    Filter2dTest builtinTest(builtinLabel.c_str(), input,
+                             StencilTest<Kernel>::makeMask());
+    Test *tests[] = { &stencilTest, &builtinTest };
+    const int testCount = sizeof tests / sizeof tests[0];
+    const bench::Params params = bench::Params().add("kernel", name);
+    for (int i = 0; i < testCount; ++i) {
+        timeTest(harness, *tests[i], runCount, params);
+    }
+    makeWindow(stencilTest.label, stencilTest.output);
+}
+
+// Time runCount runs of a T test on input.
+//
+template <typename T>
+static void showThroughput(bench::Harness &harness, const cv::Mat &input,
+                           int runCount, const bench::Params &params)
+{
+    T test(input);
+    timeTest(harness, test, runCount, params);
+}
+
+// Show the throughput of each test on copies of image resized from a
+// quarter megapixel up to 100 megapixels.  Run each test long enough to
+// scan about 100 megapixels, after a single warm-up run.
+//
+static void showThroughputs(bench::Harness &harness, const cv::Mat &image)
+{
+    static const double megapixels[] = { 0.25, 1, 4, 16, 64, 100 };
+    static const int count = sizeof megapixels / sizeof megapixels[0];
+    const int warmCount = harness.warmCount;
+    harness.warmCount = 1;
+    for (int i = 0; i < count; ++i) {
+        const double scale = std::sqrt(megapixels[i] * 1e6 / image.total());
+        cv::Mat input;
+        cv::resize(image, input, cv::Size(), scale, scale);
+        const int runCount = std::max(3, int(100 / megapixels[i]));
+        const bench::Params params
+            = bench::Params().add("megapixels", megapixels[i]);
+        std::cout << megapixels[i] << " MP (" << input.cols << " x "
+                  << input.rows << ") " << runCount << " runs:" << std::endl;
+        showThroughput<HandCodedTest>(harness, input, runCount, params);
+        showThroughput<SimdTest>(harness, input, runCount, params);
+        showThroughput<TiledTest>(harness, input, runCount, params);
+        showThroughput<Filter2dTest>(harness, input, runCount, params);
+    }
+    harness.warmCount = warmCount;
+}
+
 int main(int ac, const char *av[])
 {
+    bench::Harness harness("mat-mask-operations", ac, av);
     const cv::Mat inputImage = useCommandLine(ac, av);
     if (!inputImage.data) return 1;
     makeWindow(av[1], inputImage, 3);
+    harness.context.add("channels", inputImage.channels());
     HandCodedTest handCodedTest(inputImage);
+    SimdTest simdTest(inputImage);
+    TiledTest tiledTest(inputImage);
     Filter2dTest builtinTest(inputImage);
-    Test *tests[] = { &handCodedTest, &builtinTest };
+    Test *tests[] = { &handCodedTest, &simdTest, &tiledTest, &builtinTest };
     const int testCount = sizeof tests / sizeof tests[0];
     for (int i = 0; i < testCount; ++i) {
         Test &test = *tests[i];
         static const int runCount = 100;
-        const int64 tickZero = cv::getTickCount();
-        for (int j = 0; j < runCount; ++j) (test)();
-        const int64 ticks = cv::getTickCount() - tickZero;
-        const double totalSeconds = (double)ticks / cv::getTickFrequency();
-        const double msPerRun = totalSeconds * 1000 / runCount;
-        std::cout << "Average " << test.label << " time in milliseconds: "
-                  << msPerRun << std::endl;
+        timeTest(harness, test, runCount);
         makeWindow(test.label, test.output);
     }
-    cv::waitKey(0);
+    static const int stencilRunCount = 100;
+    showStencil<Sharpen>(harness, inputImage, stencilRunCount);
+    showStencil<Laplacian>(harness, inputImage, stencilRunCount);
+    showStencil<Box>(harness, inputImage, stencilRunCount);
+    showStencil<Emboss>(harness, inputImage, stencilRunCount);
+    showThroughputs(harness, inputImage);
+    if (!bench::batch()) cv::waitKey(0);
     return 0;
 }
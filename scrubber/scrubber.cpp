@@ -1,73 +1,366 @@
+#include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
+#include <condition_variable>
+#include <cstdlib>
 #include <iostream>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
+#include "capture.hpp"
 
-// Just cv::VideoCapture extended for the convenience of VideoPlayer.
+
+// Decoded frames of a video file for random access by frame number.
+//
+// A fill thread decodes the frame last asked for by get() and then
+// prefetches the frames around it into an LRU cache bounded by a memory
+// budget.  It decodes forward from where its capture is when the frame
+// wanted is a short way ahead, and seeks only when it is not.
+//
+// Playing forward faster than FPS shows only every step frame, so the
+// fill thread prefetches only those.  It still decodes the frames between
+// them, since decoding forward needs them, but it neither copies them
+// nor spends the cache on them.
 //
-struct CvVideoCapture: cv::VideoCapture {
+// Playing in reverse, the fill thread decodes a group of batch frames
+// forward from its first frame after one seek, and the player presents
+// the group backwards from the cache.  Then it prefetches the group
+// before, so reverse play costs one seek per group rather than per frame.
+//
+// An index thread makes one pass over the file on a capture of its own,
+// keeping a small JPEG thumbnail of every indexStride frame.  That seek
+// index shows something close at once for frames not yet decoded, and
+// finds the true number of frames in the file.
+//
+class FrameCache {
+
+    enum { ahead = 48 };                // frames to prefetch after wanted
+    enum { behind = 16 };               // frames to prefetch before wanted
+    enum { forwardLimit = 32 };         // decode this far rather than seek
+    enum { indexStride = 8 };           // frames per thumbnail
+    enum { thumbnailScale = 4 };        // thumbnails are this much smaller
+    enum { batch = 32 };                // frames per group decoded reversed
+
+    // A cached frame and its place in lru.
+    //
+    struct Entry { cv::Mat frame; std::list<int>::iterator at; };
+
+    const std::string fileName;         // the video file
+    CvVideoCapture video;               // read only by the fill thread
+    const cv::Size frameSize;           // the size of each frame
+    size_t capacity;                    // the most frames to cache
+    int frameCount;                     // the frames in the file
+    int wanted;                         // the frame last asked for
+    bool reverse;                       // true to prefetch backwards
+    int step;                           // frames between frames played
+    std::unordered_map<int, Entry> cache; // decoded frames by number
+    std::list<int> lru;                 // most recently used first
+    std::vector<std::vector<uchar> > thumbnail; // JPEG of every stride frame
+    int hitCount, missCount;            // the frames get() found or not
+    bool stop;                          // true to stop the threads
+
+    mutable std::mutex mutex;           // guards all of the above
+    std::condition_variable work;       // wanted changed or stop
+    std::thread filler;                 // runs fill()
+    std::thread indexer;                // runs index()
+
+    bool isCached(int p) const { return cache.count(p) != 0; }
+
+    // Return the first frame missing from the group of batch frames that
+    // holds wanted up to wanted, else from the group before, or -1.
+    //
+    int nextReverseTarget(void) const {
+        const int first = wanted - wanted % batch;
+        for (int p = first; p <= wanted && p < frameCount; ++p) {
+            if (!isCached(p)) return p;
+        }
+        for (int p = std::max(0, first - batch); p < first; ++p) {
+            if (!isCached(p)) return p;
+        }
+        return -1;
+    }
+
+    // Return the next frame the fill thread should decode, or -1 if the
+    // frames around wanted are all cached.
+    //
+    // Behind wanted, return the farthest frame missing so that decoding
+    // forward from it fills the gap without another seek.
+    //
+    int nextTarget(void) const {
+        if (reverse) return nextReverseTarget();
+        for (int i = 0; i < ahead; ++i) {
+            const int p = wanted + i * step;
+            if (p >= frameCount) break;
+            if (!isCached(p)) return p;
+        }
+        for (int i = behind; i > 0; --i) {
+            const int p = wanted - i;
+            if (p >= 0 && p < frameCount && !isCached(p)) return p;
+        }
+        return -1;
+    }
+
+    // Cache frame as frame p, evicting the least recently used frames to
+    // stay within capacity.
+    //
+    void insert(int p, const cv::Mat &frame) {
+        if (isCached(p)) return;
+        lru.push_front(p);
+        Entry &entry = cache[p];
+        entry.frame = frame;
+        entry.at = lru.begin();
+        while (cache.size() > capacity) {
+            cache.erase(lru.back());
+            lru.pop_back();
+        }
+    }
+
+    // Decode the frames nextTarget() names until stop.
+    //
+    void fill(void) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            int target = -1;
+            work.wait(lock, [&]{
+                return stop || (target = nextTarget()) >= 0;
+            });
+            if (stop) return;
+            lock.unlock();
+            const int at = video.getPosition();
+            if (target < at || target - at > forwardLimit) {
+                video.setPosition(target);
+            }
+            const int p = video.getPosition();
+            cv::Mat frame;
+            const bool ok = video.read(frame);
+            lock.lock();
+            if (ok) {
+                if (step == 1 || p == target) insert(p, frame);
+            } else {
+                frameCount = std::min(frameCount, p);
+            }
+        }
+    }
+
+    // Make one pass over the file keeping a thumbnail of every stride
+    // frame, and count its frames.
+    //
+    void index(void) {
+        std::vector<int> params;
+        params.push_back(cv::IMWRITE_JPEG_QUALITY);
+        params.push_back(80);
+        cv::VideoCapture pass(fileName);
+        cv::Mat frame, small;
+        int p = 0;
+        for (; pass.grab(); ++p) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stop) return;
+            }
+            if (p % indexStride) continue;
+            pass.retrieve(frame);
+            const double f = 1.0 / thumbnailScale;
+            cv::resize(frame, small, cv::Size(), f, f, cv::INTER_AREA);
+            std::vector<uchar> buffer;
+            cv::imencode(".jpg", small, buffer, params);
+            std::lock_guard<std::mutex> lock(mutex);
+            thumbnail.push_back(std::vector<uchar>());
+            thumbnail.back().swap(buffer);
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (p) frameCount = p;
+    }
+
+    FrameCache(const FrameCache &);
+    FrameCache &operator=(const FrameCache &);
+
+public:
 
-    double getFramesPerSecond() {
-        const double fps = this->get(cv::CAP_PROP_FPS);
-        return fps ? fps : 30.0;        // for MacBook iSight camera
+    double getFramesPerSecond(void) const {
+        return video.getFramesPerSecond();
     }
 
-    int getFourCcCodec() {
-        return this->get(cv::CAP_PROP_FOURCC);
+    // Return the number of frames, which the index pass may correct.
+    //
+    int getFrameCount(void) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return frameCount;
     }
 
-    const char *getFourCcCodecString() {
-        static int code = 0;
-        static char result[5] = "";
-        if (code == 0) {
-            code = this->getFourCcCodec();
-            result[0] = ((code & 0x000000ff) >>  0);
-            result[1] = ((code & 0x0000ff00) >>  8);
-            result[2] = ((code & 0x00ff0000) >> 16);
-            result[3] = ((code & 0xff000000) >> 24);
-            result[4] = ""[0];
+    bool isOpened(void) const { return video.isOpened(); }
+
+    // Prefetch groups of frames before wanted if r, else frames after.
+    //
+    void setReverse(bool r) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (reverse != r) {
+            reverse = r;
+            work.notify_one();
         }
-        return result;
     }
 
-    int getFrameCount() {
-        return this->get(cv::CAP_PROP_FRAME_COUNT);
+    // Prefetch only every s frames after wanted.
+    //
+    void setStep(int s) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (step != s) {
+            step = std::max(1, s);
+            work.notify_one();
+        }
     }
 
-    cv::Size getFrameSize() {
-        const int w = this->get(cv::CAP_PROP_FRAME_WIDTH);
-        const int h = this->get(cv::CAP_PROP_FRAME_HEIGHT);
-        const cv::Size result(w, h);
-        return result;
+    // Ask for frame p.  Return true with frame p in frame if it is cached.
+    // Otherwise return false, and the fill thread decodes it next.
+    //
+    // The cached frame is shared, not copied, since no thread writes to a
+    // frame once it is cached.
+    //
+    bool get(int p, cv::Mat &frame) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const bool asked = wanted != p;
+        if (asked) {
+            wanted = p;
+            work.notify_one();
+        }
+        const std::unordered_map<int, Entry>::iterator it = cache.find(p);
+        if (it == cache.end()) {
+            if (asked) ++missCount;
+            return false;
+        }
+        ++hitCount;
+        lru.splice(lru.begin(), lru, it->second.at);
+        frame = it->second.frame;
+        return true;
     }
 
-    int getPosition(void) { return this->get(cv::CAP_PROP_POS_FRAMES); }
-    void setPosition(int p) { this->set(cv::CAP_PROP_POS_FRAMES, p); }
+    // Return true with the indexed thumbnail nearest before frame p
+    // scaled up to the size of the video in frame, or false if there is
+    // none yet.
+    //
+    // Scale into a new Mat, since frame may share the buffer of a cached
+    // frame from get().
+    //
+    bool getThumbnail(int p, cv::Mat &frame) const {
+        std::vector<uchar> buffer;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (thumbnail.empty()) return false;
+            const size_t i = std::max(0, p) / indexStride;
+            buffer = thumbnail[std::min(i, thumbnail.size() - 1)];
+        }
+        const cv::Mat small = cv::imdecode(buffer, cv::IMREAD_COLOR);
+        if (!small.data) return false;
+        cv::Mat large;
+        cv::resize(small, large, frameSize, 0, 0, cv::INTER_LINEAR);
+        frame = large;
+        return true;
+    }
+
+    // Show on os how often get() found its frame cached.
+    //
+    void report(std::ostream &os) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        os << "Frame cache: " << hitCount << " hits, " << missCount
+           << " misses, " << cache.size() << " of " << capacity
+           << " frames, " << thumbnail.size() << " thumbnails."
+           << std::endl;
+    }
 
-    CvVideoCapture(const std::string &fileName): VideoCapture(fileName) {}
-    CvVideoCapture(int n): VideoCapture(n) {}
-    CvVideoCapture(): VideoCapture() {}
+    ~FrameCache() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        work.notify_all();
+        if (filler.joinable()) filler.join();
+        if (indexer.joinable()) indexer.join();
+    }
+
+    // Cache up to megabytes of decoded frames from the video file named f.
+    //
+    FrameCache(const char *f, int megabytes):
+        fileName(f), video(fileName), frameSize(video.getFrameSize()),
+        frameCount(video.getFrameCount()), wanted(0), reverse(false), step(1),
+        hitCount(0), missCount(0), stop(false)
+    {
+        const size_t frameBytes = std::max(1, frameSize.area()) * 3;
+        const size_t budget = size_t(std::max(1, megabytes)) << 20;
+        const size_t least = 2 * (ahead + behind + 2 * batch);
+        capacity = std::max(least, budget / frameBytes);
+        if (video.isOpened()) {
+            filler = std::thread(&FrameCache::fill, this);
+            indexer = std::thread(&FrameCache::index, this);
+        }
+    }
 };
 
 
 // Play video from file with title at FPS or by stepping frames using a
-// trackbar as a scrub control.
+// trackbar as a scrub control, forward or in reverse, and at 1/2, 1, 2,
+// or 4 times FPS.  Faster than FPS skips frames rather than showing them
+// sooner.
+//
+// Frames come from a FrameCache, so scrubbing back over frames already
+// seen shows them at once.  A frame not yet decoded shows its nearest
+// thumbnail until it arrives.
 //
 class VideoPlayer {
 
-    CvVideoCapture video;
+    enum { pollMs = 10 };               // wait for a frame not yet decoded
+    enum { SPEEDS = 4 };                // the number of speeds
+
+    FrameCache cache;
     const char *const title;
     const int msDelay;
-    const int frameCount;
+    int frameCount;                     // as last corrected by the cache
     cv::Mat frame;
     int position;
+    bool exact;                         // true if frame is at position
     enum State { RUN, STEP } state;
+    int direction;                      // 1 forward or -1 in reverse
+    int speed;                          // the index of speed in speeds
+
+    // Return the speed as a multiple of FPS.
+    //
+    double getSpeed(void) const {
+        static const double speeds[SPEEDS] = { 0.5, 1.0, 2.0, 4.0 };
+        return speeds[speed];
+    }
+
+    // Show the direction and speed on std::cout.
+    //
+    void showSpeed(void) const {
+        std::cout << title << ": " << (state == RUN ? "Run " : "Step ")
+                  << (direction > 0 ? "forward" : "reverse") << " at "
+                  << getSpeed() << "x" << std::endl;
+    }
+
+    // Play in direction d.
+    //
+    void setDirection(int d) {
+        direction = d;
+        cache.setReverse(d < 0);
+    }
+
+    // Move position by n frames but not off either end.
+    //
+    void advance(int n) {
+        position = std::max(0, std::min(position + n, frameCount - 1));
+    }
 
     // Show the frame at position updating the trackbar as necessary.
+    // Show its nearest thumbnail if the frame is not decoded yet.
+    //
+    // Keep position within the frame count the cache has now, since the
+    // count the file claims may be too high.
     //
     void showFrame(void) {
-        video >> frame;
-        if (frame.data) {
-            position = video.getPosition();
+        frameCount = cache.getFrameCount();
+        position = std::max(0, std::min(position, frameCount - 1));
+        exact = cache.get(position, frame);
+        if (exact || cache.getThumbnail(position, frame)) {
             cv::setTrackbarPos("Position", title, position);
             cv::imshow(title, frame);
         }
@@ -78,42 +371,67 @@ class VideoPlayer {
     static void track(int position, void *p)
     {
         VideoPlayer *const pV = (VideoPlayer *)p;
-        pV->video.setPosition(position);
+        pV->position = position;
         pV->state = VideoPlayer::STEP;
         pV->showFrame();
     }
 
 public:
 
-    ~VideoPlayer() { cv::destroyWindow(title); }
+    ~VideoPlayer() {
+        cache.report(std::cout);
+        cv::destroyWindow(title);
+    }
 
-    // Show frames at FPS if RUNning or one at a time if STEPping.
+    // Show frames at speed times FPS if RUNning or one at a time if
+    // STEPping.  Step back on b and forward on any other key, and poll
+    // until the frame shown is exact.
     //
     void operator()(void) {
         while (true) {
+            const double x = getSpeed();
+            const int runDelay = x < 1.0 ? msDelay / x : msDelay;
+            const int stride = x > 1.0 ? x : 1;
+            cache.setStep(state == RUN && direction > 0 ? stride : 1);
             showFrame();
-            const int wait = state == RUN ? msDelay : 0;
-            const char c = cv::waitKey(wait);
+            const int wait
+                = state == RUN ? runDelay : exact ? 0 : int(pollMs);
+            const int c = cv::waitKey(wait);
             switch (c) {
             case 'q': case 'Q': return;
-            case 'r': case 'R': state = RUN;  break;
+            case 'r': case 'R': state = RUN;  setDirection(1);  break;
+            case 'v': case 'V': state = RUN;  setDirection(-1); break;
             case 's': case 'S': state = STEP; break;
+            case 'b': case 'B': state = STEP; setDirection(-1); break;
+            case '<': speed = std::max(0, speed - 1);          break;
+            case '>': speed = std::min(SPEEDS - 1, speed + 1); break;
+            }
+            if (c != -1) showSpeed();
+            if (state == RUN) {
+                if (exact) advance(direction * stride);
+            } else if (c == 'b' || c == 'B') {
+                advance(-1);
+            } else if (c != -1 && c != '<' && c != '>') {
+                setDirection(1);
+                advance(1);
             }
         }
     }
 
     // True if this can play.
     //
-    operator bool() const { return video.isOpened(); }
+    operator bool() const { return cache.isOpened(); }
 
-    VideoPlayer(const char *t):
-        video(t), msDelay(1000 / video.getFramesPerSecond()),
-        frameCount(video.getFrameCount()),
-        title(t), position(0), state(STEP)
+    VideoPlayer(const char *t, int megabytes):
+        cache(t, megabytes), title(t),
+        msDelay(1000 / cache.getFramesPerSecond()),
+        frameCount(cache.getFrameCount()),
+        position(0), exact(false), state(STEP), direction(1), speed(1)
     {
         if (*this) {
             cv::namedWindow(title, cv::WINDOW_AUTOSIZE);
-            cv::createTrackbar("Position", title, &position, frameCount,
+            cv::createTrackbar("Position", title, &position,
+                               std::max(0, frameCount - 1),
                                &VideoPlayer::track, this);
         }
     }
@@ -122,13 +440,20 @@ public:
 
 int main(int ac, const char *av[])
 {
-    if (ac == 2) {
-        VideoPlayer play(av[1]);
+    if (ac == 2 || ac == 3) {
+        const int megabytes = ac == 3 ? atoi(av[2]) : 512;
+        VideoPlayer play(av[1], megabytes);
         if (play) {
             std::cout << std::endl
                       << av[0] << ": Press q to quit." << std::endl
                       << av[0] << ": Press r to run video." << std::endl
+                      << av[0] << ": Press v to run video in reverse."
+                      << std::endl
                       << av[0] << ": Press s to step a frame." << std::endl
+                      << av[0] << ": Press b to step back a frame."
+                      << std::endl
+                      << av[0] << ": Press < or > to run slower or faster."
+                      << std::endl
                       << av[0] << ": Or drag the Position trackbar."
                       << std::endl;
             play();
@@ -137,10 +462,13 @@ int main(int ac, const char *av[])
     }
     std::cerr << av[0] << ": Show a video with scrubber control." << std::endl
               << std::endl
-              << "Usage: " << av[0] << " <video-file>" << std::endl
-              << std::endl
+              << "Usage: " << av[0] << " <video-file> [<cache-MB>]"
+              << std::endl << std::endl
               << "Where: <video-file> is a video file." << std::endl
+              << "       <cache-MB> is the most memory to use for"
               << std::endl
+              << "                  decoded frames (default 512)."
+              << std::endl << std::endl
               << "Example: " << av[0] << " ../resources/Megamind.avi"
               << std::endl << std::endl;
     return 1;
@@ -2,15 +2,39 @@
 #include <string>
 #include <iomanip>
 #include <sstream>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <bitset>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <queue>
+#include <thread>
+#include <vector>
 
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "capture.hpp"
+
 static void showUsage(const char *av0)
 {
     std::cout << av0 << ": Measure video similarity with PSNR and MSSIM."
               << std::endl << std::endl
               << "Usage: " << av0 << " <reference> <test> <trigger> <delay>"
+              << std::endl
+              << "   or: " << av0 << " <reference> <test> <trigger>"
+              << " --pipeline <workers>"
+              << std::endl
+              << "   or: " << av0 << " --batch <stem> <reference>"
+              << " <test> ..."
               << std::endl << std::endl
               << "Where: <reference> is a video file against which to"
               << std::endl
@@ -23,10 +47,56 @@ static void showUsage(const char *av0)
               << "                 PSNR is a useful measure of difference."
               << std::endl
               << "       <delay> is the time to pause between frames."
+              << std::endl
+              << "       <workers> is the number of threads comparing"
+              << std::endl
+              << "                 frames without display, or 0 for one"
+              << std::endl
+              << "                 per CPU."
+              << std::endl
+              << "       <stem> names the CSV files to write:"
+              << std::endl
+              << "              <stem>-frames.csv for each frame of each"
+              << std::endl
+              << "              <test> and <stem>-summary.csv for each"
+              << std::endl
+              << "              <test>."
+              << std::endl
+              << "       Add --fast <scale> to any to find MSSIM over"
+              << std::endl
+              << "       box windows of the frames shrunk by <scale>, and"
+              << std::endl
+              << "       map the SSIM of each 32 x 32 tile."
+              << std::endl
+              << "       Add --align <frames> to either of the first two to"
+              << std::endl
+              << "       first match the frames of <test> to <reference> by"
+              << std::endl
+              << "       perceptual hash, trying offsets of up to <frames>"
+              << std::endl
+              << "       frames and drifts of up to 5%.  Only the first"
+              << std::endl
+              << "       <span> frames of <test> are hashed, 300 unless"
+              << std::endl
+              << "       --span <span> is added too.  --batch does not"
+              << std::endl
+              << "       align."
               << std::endl << std::endl
               << "Example: " << av0 << " ../resources/Megamind.avi \\"
               << std::endl
               << "                     ../resources/Megamind_bugy.avi 35 10"
+              << std::endl
+              << "Example: " << av0 << " ../resources/Megamind.avi \\"
+              << std::endl
+              << "                     ../resources/Megamind_bugy.avi 35 \\"
+              << std::endl
+              << "                     --pipeline 0 --fast 2"
+              << std::endl
+              << "Example: " << av0 << " --batch ladder \\"
+              << std::endl
+              << "                     ../resources/Megamind.avi \\"
+              << std::endl
+              << "                     ../resources/Megamind_bugy.avi"
               << std::endl << std::endl;
 }
 
@@ -81,97 +151,446 @@ static cv::Mat absDiff(const cv::Mat &image1, const cv::Mat &image2)
     return result;
 }
 
-// Return the PSNR between image1 and image1 or 0.0 if below epsilon.
+// The bytes in a block of sumSquaredDiff8u(), a multiple of 16 that each
+// pixel of 1 to 4 channels divides evenly.
 //
-// Sum of squares of the absolute difference between two images averaged
-// over the number of pixels and channels in the images -- expressed as
-// the common log of the ratio of the maximum pixel value to the average.
+enum { SSD_BLOCK = 48 };
+
+// Add to total[o] the squared differences of the n bytes at p and q whose
+// offsets are o modulo SSD_BLOCK.
 //
-// sumSquared = sumOverChannels(sumOverPixels(square(|image1 - image2|)))
-// meanSquared = sumSquared / channelCount / pixelCount
-// psnr = 10 * log(maxSquared / meanSquared)
+// Each SSE2 lane holds one offset of the block.  Squares of byte
+// differences fit in 16 bits unsigned, and each 32-bit lane can take
+// 65535 of them before it drains into the 64-bit totals.
+//
+static void sumSquaredDiff8u(const uchar *p, const uchar *q, int n,
+                             uint64 total[SSD_BLOCK])
+{
+    int i = 0;
+#if defined(__SSE2__)
+    enum { VECTORS = SSD_BLOCK / 16, LANES = 4 * VECTORS, DRAIN = 65535 };
+    const __m128i zero = _mm_setzero_si128();
+    while (i + SSD_BLOCK <= n) {
+        __m128i sum[LANES];
+        for (int k = 0; k < LANES; ++k) sum[k] = zero;
+        for (int b = 0; b < DRAIN && i + SSD_BLOCK <= n; ++b) {
+            for (int k = 0; k < VECTORS; ++k, i += 16) {
+                const __m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+                const __m128i y = _mm_loadu_si128((const __m128i *)(q + i));
+                const __m128i d
+                    = _mm_or_si128(_mm_subs_epu8(x, y), _mm_subs_epu8(y, x));
+                const __m128i lo = _mm_unpacklo_epi8(d, zero);
+                const __m128i hi = _mm_unpackhi_epi8(d, zero);
+                const __m128i lo2 = _mm_mullo_epi16(lo, lo);
+                const __m128i hi2 = _mm_mullo_epi16(hi, hi);
+                __m128i *const s = sum + 4 * k;
+                s[0] = _mm_add_epi32(s[0], _mm_unpacklo_epi16(lo2, zero));
+                s[1] = _mm_add_epi32(s[1], _mm_unpackhi_epi16(lo2, zero));
+                s[2] = _mm_add_epi32(s[2], _mm_unpacklo_epi16(hi2, zero));
+                s[3] = _mm_add_epi32(s[3], _mm_unpackhi_epi16(hi2, zero));
+            }
+        }
+        unsigned lanes[SSD_BLOCK];
+        for (int k = 0; k < LANES; ++k) {
+            _mm_storeu_si128((__m128i *)(lanes + 4 * k), sum[k]);
+        }
+        for (int o = 0; o < SSD_BLOCK; ++o) total[o] += lanes[o];
+    }
+#endif
+    for (; i < n; ++i) {
+        const int d = int(p[i]) - int(q[i]);
+        total[i % SSD_BLOCK] += d * d;
+    }
+}
+
+// Return the sum of the squared differences of each channel of image1 and
+// image2.  Sum 8-bit images of up to 4 channels in one pass with no
+// temporaries.  Convert anything else to float first.
+//
+static cv::Scalar sumSquaredDiff(const cv::Mat &image1, const cv::Mat &image2)
+{
+    const int channelCount = image1.channels();
+    if (image1.depth() != CV_8U || channelCount > 4) {
+        const cv::Mat diff = absDiff(floatImage(image1), floatImage(image2));
+        return cv::sum(square(diff));
+    }
+    const bool continuous = image1.isContinuous() && image2.isContinuous();
+    const int rows = continuous ? 1 : image1.rows;
+    const int n = image1.cols * channelCount * (continuous ? image1.rows : 1);
+    uint64 total[SSD_BLOCK] = {};
+    for (int r = 0; r < rows; ++r) {
+        sumSquaredDiff8u(image1.ptr(r), image2.ptr(r), n, total);
+    }
+    cv::Scalar result;
+    for (int o = 0; o < SSD_BLOCK; ++o) result[o % channelCount] += total[o];
+    return result;
+}
+
+// Return the PSNR of sumSquared over count values or 0.0 if below epsilon.
 //
-static double getPsnr(const cv::Mat &image1, const cv::Mat &image2)
+static double psnrOf(double sumSquared, double count)
 {
     static const int max = std::numeric_limits<uchar>::max();
     static const double maxSquared = max * max;
     static const double epsilon    = 1e-10;
-    const int channelCount = image1.channels();
-    const int pixelCount = image1.total();
-    const cv::Mat diff = absDiff(floatImage(image1), floatImage(image2));
-    const cv::Scalar sumPixels = cv::sum(square(diff));
-    double sumSquared = 0.0;
-    for (int i = 0; i < channelCount; ++i) sumSquared += sumPixels.val[i];
     if (sumSquared > epsilon) {
-        const double meanSquared = sumSquared / channelCount / pixelCount;
+        const double meanSquared = sumSquared / count;
         return 10.0 * log10(maxSquared / meanSquared);
     }
     return 0.0;
 }
 
-// Return image blurred with kernel and sigmaX.
+// Return the PSNR between image1 and image2 or 0.0 if below epsilon, and
+// the PSNR of each channel in channelPsnr.
+//
+// Sum of squares of the absolute difference between two images averaged
+// over the number of pixels and channels in the images -- expressed as
+// the common log of the ratio of the maximum pixel value to the average.
+//
+// sumSquared = sumOverChannels(sumOverPixels(square(|image1 - image2|)))
+// meanSquared = sumSquared / channelCount / pixelCount
+// psnr = 10 * log(maxSquared / meanSquared)
 //
-static cv::Mat blur(const cv::Mat &image)
+static double getPsnr(const cv::Mat &image1, const cv::Mat &image2,
+                      cv::Scalar &channelPsnr)
 {
-    static const cv::Size kernel(11, 11);
-    static const double sigmaX = 1.5;
-    cv::Mat result;
-    cv::GaussianBlur(image, result, kernel, sigmaX);
-    return result;
-}
-
-// Return the MSSIM calculated over image1 and image2.
-//
-// numerator   = ((2 * mu1 * mu2 + C1) * (2 * sigma1 * sigma2 + C2))
-// denominator = ((square(mu1) + square(mu2) + C1)
-//             * (square(sigma1) + square(sigma2) + C2))
-// mssim = mean(numerator /denominator)
-//
-static cv::Scalar getMssim(const cv::Mat &image1, const cv::Mat &image2)
-{
-    static const double C1        = 6.5025;
-    static const double C2        = 58.5225;
-    const cv::Mat float1          = floatImage(image1);
-    const cv::Mat float2          = floatImage(image2);
-    const cv::Mat mu1             = blur(float1);
-    const cv::Mat mu2             = blur(float2);
-    const cv::Mat mu1squared      = square(mu1);
-    const cv::Mat mu2squared      = square(mu2);
-    const cv::Mat mu1_x_mu2       = mu1.mul(mu2);
-    const cv::Mat sigma1squared   = blur(square(float1))     - mu1squared;
-    const cv::Mat sigma2squared   = blur(square(float2))     - mu2squared;
-    const cv::Mat sigma1_x_sigma2 = blur(float1.mul(float2)) - mu1_x_mu2;
-    const cv::Mat numerator1      = 2 * mu1_x_mu2       + C1;
-    const cv::Mat numerator2      = 2 * sigma1_x_sigma2 + C2;
-    const cv::Mat numerator       = numerator1.mul(numerator2);
-    const cv::Mat denominator1    = mu1squared    + mu2squared    + C1;
-    const cv::Mat denominator2    = sigma1squared + sigma2squared + C2;
-    const cv::Mat denominator     = denominator1.mul(denominator2);
-    cv::Mat ssimMap;
-    cv::divide(numerator, denominator, ssimMap);
-    const cv::Scalar result = cv::mean(ssimMap);
-    return result;
+    const int channelCount = image1.channels();
+    const double pixelCount = image1.total();
+    const cv::Scalar sumPixels = sumSquaredDiff(image1, image2);
+    double sumSquared = 0.0;
+    for (int i = 0; i < channelCount; ++i) {
+        sumSquared += sumPixels.val[i];
+        channelPsnr.val[i] = psnrOf(sumPixels.val[i], pixelCount);
+    }
+    return psnrOf(sumSquared, channelCount * pixelCount);
 }
 
-// Just cv::VideoCapture extended for convenience.
+// Compute MSSIM in a few fused passes, reusing one workspace for every
+// pair of frames.
+//
+// The first pass packs x, y, x*x, y*y, and x*y for each channel of a
+// strip of rows into one float image, so a single separable blur finds
+// all the local means.  The blur convolves the strip with an 11-tap
+// Gaussian kernel computed once, into workspace kept with the engine,
+// where GaussianBlur() would build a new filter for every strip.  The
+// second pass turns those means into the SSIM of each pixel and sums
+// them per channel.  Strips overlap by the radius of the blur so each
+// strip's rows see the same neighbors they would in the whole frame.
+//
+// mu1 = blur(x)  sigma1squared = blur(x * x) - mu1 * mu1
+// mu2 = blur(y)  sigma2squared = blur(y * y) - mu2 * mu2
+//                sigma12       = blur(x * y) - mu1 * mu2
+// numerator   = (2 * mu1 * mu2 + C1) * (2 * sigma12 + C2)
+// denominator = (mu1 * mu1 + mu2 * mu2 + C1)
+//             * (sigma1squared + sigma2squared + C2)
+// mssim = mean(numerator / denominator)
+//
+// An engine made with a scale of 1 or more instead takes the local means
+// over 8 x 8 box windows of the frames shrunk by that scale.  It keeps
+// only the last 9 rows of an integral image of the same 5 statistics,
+// so each window costs 4 lookups per statistic whatever its size.  The
+// integrals are unsigned 32-bit and wrap, which is harmless because every
+// window sum fits.  It also averages the SSIM of the windows centered in
+// each tile of 32 x 32 frame pixels into a coarse map of the frame.
 //
-struct CvVideoCapture: cv::VideoCapture {
-    double framesPerSecond() {
-        const double fps = this->get(cv::CAP_PROP_FPS);
-        return fps ? fps : 30.0;        // for MacBook iSight camera
+class SsimEngine {
+
+    enum { STATS = 5 };                 // x, y, x*x, y*y, x*y
+    enum { radius = 5 };                // of the 11 x 11 Gaussian kernel
+    enum { stripRows = 32 };            // rows of SSIM per strip
+    enum { window = 8 };                // the side of a box window
+    enum { tileSize = 32 };             // the side of a map tile in pixels
+
+    const int scale;                    // box downscale or 0 for Gaussian
+    float weight[2 * radius + 1];       // the Gaussian kernel
+    cv::Mat stats;                      // STATS floats per pixel channel
+    cv::Mat line;                       // a row of stats blurred down
+    cv::Mat means;                      // stats blurred
+    cv::Mat smallX, smallY;             // the frames shrunk by scale
+    cv::Mat integral;                   // the last window + 1 integral rows
+    cv::Mat tileSum;                    // the SSIM of the windows in a tile
+    cv::Mat tileCount;                  // the windows in a tile
+    cv::Mat tiles;                      // tileSum / tileCount
+
+    // Pack the statistics of rows [top, bottom) of x and y into stats.
+    //
+    static void pack(const cv::Mat &x, const cv::Mat &y, int top, int bottom,
+                     cv::Mat &stats)
+    {
+        const int n = x.cols * x.channels();
+        for (int r = top; r < bottom; ++r) {
+            const uchar *const p = x.ptr(r);
+            const uchar *const q = y.ptr(r);
+            float *s = stats.ptr<float>(r - top);
+            for (int i = 0; i < n; ++i, s += STATS) {
+                const float a = p[i];
+                const float b = q[i];
+                s[0] = a; s[1] = b; s[2] = a * a; s[3] = b * b; s[4] = a * b;
+            }
+        }
     }
-    int count() {
-        return this->get(cv::CAP_PROP_FRAME_COUNT);
+
+    // Blur stats into means with the kernel in weight, reflecting at the
+    // edges of stats as BORDER_REFLECT_101 does.  Blur each row of stats
+    // down its columns into line, padded by radius pixels on each side,
+    // then across line into the row of means.  Each pass runs over blocks
+    // of floats small enough that the sums stay in L1 cache for all the
+    // taps of the kernel.
+    //
+    void blur(const cv::Mat &stats, cv::Mat &means) {
+        static const int border = cv::BORDER_REFLECT_101;
+        static const int block = 512;
+        const int k = stats.channels();
+        const int n = stats.cols * k;
+        float *const l = line.ptr<float>(0) + radius * k;
+        const float *row[2 * radius + 1];
+        for (int r = 0; r < stats.rows; ++r) {
+            for (int i = -radius; i <= radius; ++i) {
+                const int y = cv::borderInterpolate(r + i, stats.rows, border);
+                row[i + radius] = stats.ptr<float>(y);
+            }
+            for (int begin = 0; begin < n; begin += block) {
+                const int end = std::min(begin + block, n);
+                std::fill(l + begin, l + end, 0.0f);
+                for (int i = 0; i <= 2 * radius; ++i) {
+                    const float *const s = row[i];
+                    const float w = weight[i];
+                    for (int j = begin; j < end; ++j) l[j] += w * s[j];
+                }
+            }
+            for (int i = 1; i <= radius; ++i) {
+                const int right = stats.cols - 1 + i;
+                const int fromLeft
+                    = cv::borderInterpolate(-i, stats.cols, border);
+                const int fromRight
+                    = cv::borderInterpolate(right, stats.cols, border);
+                std::copy(l + fromLeft * k, l + fromLeft * k + k, l - i * k);
+                std::copy(l + fromRight * k, l + fromRight * k + k,
+                          l + right * k);
+            }
+            float *const m = means.ptr<float>(r);
+            for (int begin = 0; begin < n; begin += block) {
+                const int end = std::min(begin + block, n);
+                std::fill(m + begin, m + end, 0.0f);
+                for (int i = -radius; i <= radius; ++i) {
+                    const float *const p = l + i * k;
+                    const float w = weight[i + radius];
+                    for (int j = begin; j < end; ++j) m[j] += w * p[j];
+                }
+            }
+        }
     }
-    cv::Size size() {
-        const int w = this->get(cv::CAP_PROP_FRAME_WIDTH);
-        const int h = this->get(cv::CAP_PROP_FRAME_HEIGHT);
-        const cv::Size result(w, h);
+
+    // Add the SSIM of rows [begin, end) of means to sum for each channel.
+    //
+    static void accumulate(const cv::Mat &means, int begin, int end,
+                           int channels, double sum[])
+    {
+        static const float C1 = 6.5025;
+        static const float C2 = 58.5225;
+        for (int r = begin; r < end; ++r) {
+            const float *m = means.ptr<float>(r);
+            for (int i = 0; i < means.cols; ++i) {
+                for (int c = 0; c < channels; ++c, m += STATS) {
+                    const float mu1 = m[0], mu2 = m[1];
+                    const float mu1mu1 = mu1 * mu1;
+                    const float mu2mu2 = mu2 * mu2;
+                    const float mu1mu2 = mu1 * mu2;
+                    const float sigma1squared = m[2] - mu1mu1;
+                    const float sigma2squared = m[3] - mu2mu2;
+                    const float sigma12 = m[4] - mu1mu2;
+                    const float numerator
+                        = (2 * mu1mu2 + C1) * (2 * sigma12 + C2);
+                    const float denominator
+                        = (mu1mu1 + mu2mu2 + C1)
+                        * (sigma1squared + sigma2squared + C2);
+                    sum[c] += numerator / denominator;
+                }
+            }
+        }
+    }
+
+    // Return the SSIM of one window from its sums s of the STATS
+    // statistics over n pixels.
+    //
+    static float boxSsim(const unsigned s[STATS], float n) {
+        static const float C1 = 6.5025;
+        static const float C2 = 58.5225;
+        const float mu1 = s[0] / n, mu2 = s[1] / n;
+        const float mu1mu1 = mu1 * mu1;
+        const float mu2mu2 = mu2 * mu2;
+        const float mu1mu2 = mu1 * mu2;
+        const float sigma1squared = s[2] / n - mu1mu1;
+        const float sigma2squared = s[3] / n - mu2mu2;
+        const float sigma12 = s[4] / n - mu1mu2;
+        const float numerator = (2 * mu1mu2 + C1) * (2 * sigma12 + C2);
+        const float denominator
+            = (mu1mu1 + mu2mu2 + C1) * (sigma1squared + sigma2squared + C2);
+        return numerator / denominator;
+    }
+
+    // Add row r of x and y to the integral row after the integral row
+    // above it.
+    //
+    void integrate(const cv::Mat &x, const cv::Mat &y, int r) {
+        const int channels = x.channels();
+        const int k = STATS * channels;
+        const unsigned *above = integral.ptr<unsigned>(r % integral.rows);
+        unsigned *row = integral.ptr<unsigned>((r + 1) % integral.rows);
+        const uchar *const p = x.ptr(r);
+        const uchar *const q = y.ptr(r);
+        std::fill(row, row + k, 0);
+        above += k; row += k;
+        unsigned sum[4 * STATS] = {};
+        for (int i = 0, col = 0; col < x.cols; ++col) {
+            for (int c = 0; c < channels; ++c, ++i) {
+                unsigned *const s = sum + STATS * c;
+                const unsigned a = p[i];
+                const unsigned b = q[i];
+                s[0] += a; s[1] += b;
+                s[2] += a * a; s[3] += b * b; s[4] += a * b;
+                for (int j = 0; j < STATS; ++j) {
+                    row[STATS * i + j] = above[STATS * i + j] + s[j];
+                }
+            }
+        }
+    }
+
+    // Return the MSSIM of each channel of x and y over box windows, and
+    // fill tiles with the mean SSIM of the windows centered in each tile.
+    //
+    cv::Scalar box(const cv::Mat &x, const cv::Mat &y) {
+        const int channels = x.channels();
+        const int k = STATS * channels;
+        const int w = std::min<int>(window, std::min(x.rows, x.cols));
+        const int tile = getTileSide();
+        const float area = w * w;
+        tileSum.create((x.rows + tile - 1) / tile,
+                       (x.cols + tile - 1) / tile, CV_64F);
+        tileCount.create(tileSum.size(), CV_32S);
+        tileSum = 0.0;
+        tileCount = 0;
+        integral.create(w + 1, (x.cols + 1) * k, CV_32S);
+        std::fill(integral.ptr<unsigned>(0),
+                  integral.ptr<unsigned>(0) + integral.cols, 0);
+        double sum[4] = { 0.0, 0.0, 0.0, 0.0 };
+        int windowCount = 0;
+        for (int r = 0; r < x.rows; ++r) {
+            integrate(x, y, r);
+            if (r + 1 < w) continue;
+            const unsigned *const bottom
+                = integral.ptr<unsigned>((r + 1) % integral.rows);
+            const unsigned *const top
+                = integral.ptr<unsigned>((r + 1 - w) % integral.rows);
+            const int tileY = (r + 1 - w / 2) / tile;
+            double *const tileRow = tileSum.ptr<double>(tileY);
+            int *const countRow = tileCount.ptr<int>(tileY);
+            for (int j = w; j <= x.cols; ++j) {
+                const int right = k * j, left = k * (j - w);
+                float ssim = 0.0;
+                for (int c = 0; c < channels; ++c) {
+                    unsigned s[STATS];
+                    for (int i = 0; i < STATS; ++i) {
+                        const int o = STATS * c + i;
+                        s[i] = bottom[right + o] - bottom[left + o]
+                            - top[right + o] + top[left + o];
+                    }
+                    const float channelSsim = boxSsim(s, area);
+                    sum[c] += channelSsim;
+                    ssim += channelSsim;
+                }
+                const int t = (j - w / 2) / tile;
+                tileRow[t] += ssim / channels;
+                ++countRow[t];
+                ++windowCount;
+            }
+        }
+        tileSum.convertTo(tiles, CV_32F);
+        for (int r = 0; r < tiles.rows; ++r) {
+            float *const t = tiles.ptr<float>(r);
+            const int *const n = tileCount.ptr<int>(r);
+            for (int i = 0; i < tiles.cols; ++i) t[i] = n[i] ? t[i] / n[i] : 1;
+        }
+        cv::Scalar result;
+        for (int c = 0; c < channels; ++c) result[c] = sum[c] / windowCount;
         return result;
     }
-    CvVideoCapture(const std::string &fileName): VideoCapture(fileName) {}
-};
 
+    // Return the MSSIM of each channel of x and y over Gaussian windows.
+    // The strips are blurred in isolation, so the rows beyond each strip in
+    // the workspace never leak into its border.
+    //
+    cv::Scalar gaussian(const cv::Mat &x, const cv::Mat &y) {
+        const int channels = x.channels();
+        const int rows = std::min(x.rows, stripRows + 2 * radius);
+        stats.create(rows, x.cols, CV_32FC(STATS * channels));
+        means.create(rows, x.cols, stats.type());
+        line.create(1, (x.cols + 2 * radius) * STATS * channels, CV_32F);
+        double sum[4] = { 0.0, 0.0, 0.0, 0.0 };
+        for (int begin = 0; begin < x.rows; begin += stripRows) {
+            const int end = std::min(begin + stripRows, x.rows);
+            const int top = std::max(begin - radius, 0);
+            const int bottom = std::min(end + radius, x.rows);
+            cv::Mat s = stats.rowRange(0, bottom - top);
+            cv::Mat m = means.rowRange(0, bottom - top);
+            pack(x, y, top, bottom, s);
+            blur(s, m);
+            accumulate(m, begin - top, end - top, channels, sum);
+        }
+        cv::Scalar result;
+        const double pixelCount = x.total();
+        for (int c = 0; c < channels; ++c) result[c] = sum[c] / pixelCount;
+        return result;
+    }
+
+public:
+
+    // Return the MSSIM of each channel of the 8-bit images x and y.
+    //
+    cv::Scalar operator()(const cv::Mat &x, const cv::Mat &y) {
+        CV_Assert(x.depth() == CV_8U && x.type() == y.type());
+        CV_Assert(x.size() == y.size() && x.channels() <= 4);
+        if (scale == 0) return gaussian(x, y);
+        if (scale == 1) return box(x, y);
+        const double f = 1.0 / scale;
+        cv::resize(x, smallX, cv::Size(), f, f, cv::INTER_AREA);
+        cv::resize(y, smallY, cv::Size(), f, f, cv::INTER_AREA);
+        return box(smallX, smallY);
+    }
+
+    // Return the SSIM of each tile of getTileSize() pixels square from the
+    // last comparison, or an empty Mat for Gaussian windows.
+    //
+    const cv::Mat &getTiles(void) const { return tiles; }
+
+    // The side of a tile in pixels of the frames shrunk by scale: as near
+    // to tileSize full-size pixels as a whole number of them allows.
+    //
+    int getTileSide(void) const {
+        return scale ? std::max(1, int(tileSize) / scale) : int(tileSize);
+    }
+
+    // The side of a tile of getTiles() in pixels of the full-size frames.
+    //
+    int getTileSize(void) const {
+        return scale ? getTileSide() * scale : int(tileSize);
+    }
+
+    // Use Gaussian windows over the whole frame when s is 0, or box
+    // windows over the frame shrunk by s.
+    //
+    explicit SsimEngine(int s = 0): scale(std::max(0, s))
+    {
+        static const double sigma = 1.5;
+        double w[2 * radius + 1];
+        double sum = 0.0;
+        for (int i = -radius; i <= radius; ++i) {
+            w[i + radius] = std::exp(-i * i / (2 * sigma * sigma));
+            sum += w[i + radius];
+        }
+        for (int i = 0; i <= 2 * radius; ++i) weight[i] = w[i] / sum;
+    }
+};
 
 // Format PSNR and SSIM nicely on an ostream.
 //
@@ -181,61 +600,631 @@ struct CvVideoCapture: cv::VideoCapture {
     << std::setw(6) << std::setprecision(2) << (SSIM) * 100 << "%"
 
 
-// Compare test to reference using PSNR, and if PSNR is less than trigger
-// also show MSSIM, with delay ms between frames.
+// The comparison of one frame of test to reference.  The MSSIM is only
+// valid when ssim is true.
+//
+struct Comparison {
+    int frame;                          // the frame number
+    bool empty;                         // true if either frame is empty
+    int channels;                       // the channels in each frame
+    double psnr;                        // PSNR of the frames
+    cv::Scalar channelPsnr;             // PSNR of each channel
+    bool ssim;                          // true if mssim is valid
+    cv::Scalar mssim;                   // MSSIM of each channel
+    cv::Mat tiles;                      // SSIM of each tile or empty
+    int tileSize;                       // the side of a tile in pixels
+};
+
+// Show the comparison c on os.
+//
+static std::ostream &operator<<(std::ostream &os, const Comparison &c)
+{
+    os << "Frame " << std::setw(3) << c.frame << ": ";
+    if (c.empty) return os << "is empty!";
+    os << "   PSNR:" << DECIBEL(c.psnr)
+       << " (R" << DECIBEL(c.channelPsnr.val[2])
+       << "  G" << DECIBEL(c.channelPsnr.val[1])
+       << "  B" << DECIBEL(c.channelPsnr.val[0]) << ")";
+    if (c.ssim) {
+        os << ",   MSSIM:"
+           << "  R" << PERCENT(c.mssim.val[2])
+           << "  G" << PERCENT(c.mssim.val[1])
+           << "  B" << PERCENT(c.mssim.val[0]);
+    }
+    if (c.ssim && !c.tiles.empty()) {
+        double worst = 0.0;
+        cv::Point at;
+        cv::minMaxLoc(c.tiles, &worst, 0, &at);
+        const int side = c.tileSize;
+        os << ",   worst tile (" << at.x * side << ", " << at.y * side
+           << "):" << PERCENT(worst);
+    }
+    return os;
+}
+
+// Return the comparison of frame number n of test and reference using
+// PSNR, and if PSNR is less than trigger also MSSIM from getMssim.
+//
+static Comparison compareFrames(SsimEngine &getMssim, int n,
+                                const cv::Mat &rFrame, const cv::Mat &tFrame,
+                                int trigger)
+{
+    Comparison result;
+    result.frame = n;
+    result.empty = rFrame.empty() || tFrame.empty();
+    result.channels = rFrame.channels();
+    result.psnr
+        = result.empty ? 0.0 : getPsnr(rFrame, tFrame, result.channelPsnr);
+    result.ssim = result.psnr > 0.0 && result.psnr < trigger;
+    result.tileSize = 0;
+    if (result.ssim) {
+        result.mssim = getMssim(rFrame, tFrame);
+        getMssim.getTiles().copyTo(result.tiles);
+        result.tileSize = getMssim.getTileSize();
+    }
+    return result;
+}
+
+// Return a 64-bit perceptual hash of frame: one bit for each of the 8 x 8
+// lowest frequencies of the DCT of frame shrunk to 32 x 32 gray pixels,
+// set when that coefficient is above the median of the others.  Similar
+// frames have hashes a small Hamming distance apart.
+//
+static uint64 perceptualHash(const cv::Mat &frame)
+{
+    static const int side = 32;
+    static const int bits = 8;
+    cv::Mat gray, small, dct;
+    cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+    cv::resize(gray, small, cv::Size(side, side), 0, 0, cv::INTER_AREA);
+    small.convertTo(small, CV_32F);
+    cv::dct(small, dct);
+    std::vector<float> low;
+    for (int r = 0; r < bits; ++r) {
+        const float *const p = dct.ptr<float>(r);
+        low.insert(low.end(), p, p + bits);
+    }
+    std::vector<float> ac(low.begin() + 1, low.end());
+    std::nth_element(ac.begin(), ac.begin() + ac.size() / 2, ac.end());
+    const float median = ac[ac.size() / 2];
+    uint64 result = 0;
+    for (size_t i = 0; i < low.size(); ++i) {
+        if (low[i] > median) result |= uint64(1) << i;
+    }
+    return result;
+}
+
+// Read up to count frames of video into their perceptual hashes in hash,
+// then rewind video.
+//
+static void hashVideo(CvVideoCapture &video, int count,
+                      std::vector<uint64> &hash)
+{
+    cv::Mat frame;
+    while (int(hash.size()) < count && video.read(frame)) {
+        hash.push_back(perceptualHash(frame));
+    }
+    video.setPosition(0);
+}
+
+// Test frame j shows reference frame offset + rate * j.  The distance is
+// the mean Hamming distance between the hashes of those frames.
+//
+struct Alignment {
+    int offset;                         // the reference frame of test 0
+    double rate;                        // reference frames per test frame
+    double distance;                    // of 64 hash bits, or -1 unknown
+    int referenceFrame(int j) const { return cvRound(offset + rate * j); }
+    Alignment(): offset(0), rate(1.0), distance(-1.0) {}
+};
+
+// Return the Alignment of the test hashes t to the reference hashes r
+// with the least mean Hamming distance, trying offsets of up to
+// maxOffset frames and drifts of up to 5% either way.  Only alignments
+// that pair at least half the test frames count.
+//
+// The search tries the smallest offsets and drifts first and keeps the
+// first of equally good alignments, so it prefers no drift and offset 0.
+//
+static Alignment searchAlignment(const std::vector<uint64> &r,
+                                 const std::vector<uint64> &t,
+                                 int maxOffset)
+{
+    static const double maxDrift = 0.05;
+    static const int driftSteps = 50;
+    const int rCount = r.size(), tCount = t.size();
+    Alignment result;
+    for (int d = 0; d <= 2 * driftSteps; ++d) {
+        const int step = d % 2 ? -(d + 1) / 2 : d / 2;
+        const double rate = 1.0 + maxDrift * step / driftSteps;
+        for (int o = 0; o <= 2 * maxOffset; ++o) {
+            const int offset = o % 2 ? -(o + 1) / 2 : o / 2;
+            int total = 0, count = 0;
+            for (int j = 0; j < tCount; ++j) {
+                const int i = cvRound(offset + rate * j);
+                if (i < 0) continue;
+                if (i >= rCount) break;
+                total += std::bitset<64>(r[i] ^ t[j]).count();
+                ++count;
+            }
+            if (count == 0 || 2 * count < tCount) continue;
+            const double distance = double(total) / count;
+            if (result.distance < 0.0 || distance < result.distance) {
+                result.offset = offset;
+                result.rate = rate;
+                result.distance = distance;
+            }
+        }
+    }
+    return result;
+}
+
+// Read pairs of frames from test and reference aligned by an Alignment.
+// Skip test frames from before the reference starts, skip reference
+// frames dropped from test, and repeat reference frames duplicated in
+// test.
+//
+class AlignedReader {
+    CvVideoCapture &reference;
+    CvVideoCapture &test;
+    const Alignment alignment;
+    int testFrame;                      // the next test frame to read
+    int referenceFrame;                 // the next reference frame to read
+    cv::Mat last;                       // reference frame referenceFrame-1
+public:
+
+    // Read the next test frame into tFrame and the reference frame it
+    // shows into rFrame, and the number of the test frame into n.  Return
+    // false at the end of either video.
+    //
+    bool read(int &n, cv::Mat &rFrame, cv::Mat &tFrame) {
+        while (test.read(tFrame)) {
+            n = testFrame++;
+            const int want = alignment.referenceFrame(n);
+            if (want < 0) continue;
+            while (referenceFrame <= want) {
+                if (!reference.read(last)) return false;
+                ++referenceFrame;
+            }
+            last.copyTo(rFrame);
+            return true;
+        }
+        return false;
+    }
+
+    AlignedReader(CvVideoCapture &r, CvVideoCapture &t, const Alignment &a):
+        reference(r), test(t), alignment(a), testFrame(0), referenceFrame(0)
+    {}
+};
+
+// Show the SSIM map tiles in window at size with darker tiles less
+// similar.
+//
+static void showTiles(const char *window, const cv::Mat &tiles,
+                      cv::Size size)
+{
+    cv::Mat gray, map;
+    tiles.convertTo(gray, CV_8U, 255);
+    cv::resize(gray, map, size, 0, 0, cv::INTER_NEAREST);
+    cv::imshow(window, map);
+}
+
+// Compare test to reference aligned by alignment using PSNR, and if PSNR
+// is less than trigger also show MSSIM, with delay ms between frames.  Use
+// box windows on the frames shrunk by scale and show the SSIM map unless
+// scale is 0.
 //
 static void compareVideos(CvVideoCapture &reference, CvVideoCapture &test,
-                          int trigger, int delay)
+                          const Alignment &alignment,
+                          int trigger, int delay, int scale)
 {
-    const cv::Size size = reference.size();
-    const int count = std::min(reference.count(), test.count());
+    const cv::Size size = reference.getFrameSize();
+    AlignedReader reader(reference, test, alignment);
     makeWindow("Reference", size, 2);
     makeWindow("Test", size);
-    for (int i = 0; i < count; ++i) {
-        std::cout << "Frame " << std::setw(3) << i << ": ";
-        cv::Mat rFrame, tFrame; reference >> rFrame; test >> tFrame;
-        if (rFrame.empty() || tFrame.empty()) {
-            std::cout << "is empty!" << std::endl;
-        } else {
-            const double psnr = getPsnr(rFrame, tFrame);
-            std::cout << "   PSNR:" << DECIBEL(psnr);
-            if (psnr > 0.0 && psnr < trigger) {
-                const cv::Scalar mssim = getMssim(rFrame, tFrame);
-                std::cout << ",   MSSIM:"
-                          << "  R" << PERCENT(mssim.val[2])
-                          << "  G" << PERCENT(mssim.val[1])
-                          << "  B" << PERCENT(mssim.val[0]);
-            }
-            std::cout << std::endl;
+    if (scale) makeWindow("SSIM Map", size);
+    SsimEngine getMssim(scale);
+    cv::Mat rFrame, tFrame;
+    int i = 0;
+    while (reader.read(i, rFrame, tFrame)) {
+        const Comparison comparison
+            = compareFrames(getMssim, i, rFrame, tFrame, trigger);
+        std::cout << comparison << std::endl;
+        if (!comparison.empty) {
             cv::imshow("Reference", rFrame);
             cv::imshow("Test", tFrame);
+            if (comparison.ssim && !comparison.tiles.empty()) {
+                showTiles("SSIM Map", comparison.tiles, size);
+            }
             const int c = cv::waitKey(delay);
             if (c != -1) break;
         }
     }
 }
 
+// A blocking queue of slot numbers that close() ends.
+//
+class SlotQueue {
+    std::queue<int> slots;
+    bool closed;
+    std::mutex mutex;
+    std::condition_variable ready;
+public:
+    void push(int slot) {
+        std::lock_guard<std::mutex> lock(mutex);
+        slots.push(slot);
+        ready.notify_one();
+    }
+    // Pop the next slot into slot and return true, or return false once
+    // the queue is closed and empty.
+    //
+    bool pop(int &slot) {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [this]{ return closed || !slots.empty(); });
+        if (slots.empty()) return false;
+        slot = slots.front();
+        slots.pop();
+        return true;
+    }
+    void close(void) {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        ready.notify_all();
+    }
+    SlotQueue(): closed(false) {}
+};
+
+// Compare test to reference like compareVideos() without the display,
+// on workerCount threads, and report the worst tile of the SSIM map.
+//
+// Each CvVideoCapture decodes its stream on its own thread.  This thread
+// pairs their frames into a fixed pool of 2 * workerCount slots, which
+// bounds the frames in flight.  The workers compare the pairs in any
+// order, and whichever worker finishes the next pair due reports it, so
+// the report stays in frame order.
+//
+static void pipelineVideos(CvVideoCapture &reference, CvVideoCapture &test,
+                           const Alignment &alignment,
+                           int trigger, int workerCount, int scale)
+{
+    struct Pair { int sequence, frame; cv::Mat reference, test; };
+    AlignedReader reader(reference, test, alignment);
+    const int64 tickZero = cv::getTickCount();
+    std::vector<Pair> pair(2 * workerCount);
+    SlotQueue empty, full;
+    for (size_t i = 0; i < pair.size(); ++i) empty.push(i);
+    std::mutex reportMutex;
+    std::map<int, Comparison> pending;
+    int next = 0;
+    std::vector<std::thread> worker;
+    for (int w = 0; w < workerCount; ++w) {
+        worker.push_back(std::thread([&]{
+            SsimEngine getMssim(scale);
+            int slot = 0;
+            while (full.pop(slot)) {
+                const Pair &p = pair[slot];
+                const int sequence = p.sequence;
+                const Comparison c = compareFrames(getMssim, p.frame,
+                                                   p.reference, p.test,
+                                                   trigger);
+                empty.push(slot);
+                std::lock_guard<std::mutex> lock(reportMutex);
+                pending[sequence] = c;
+                std::map<int, Comparison>::iterator it;
+                while ((it = pending.find(next)) != pending.end()) {
+                    std::cout << it->second << std::endl;
+                    pending.erase(it);
+                    ++next;
+                }
+            }
+        }));
+    }
+    int count = 0;
+    for (int slot = 0; empty.pop(slot); ++count) {
+        Pair &p = pair[slot];
+        if (!reader.read(p.frame, p.reference, p.test)) break;
+        p.sequence = count;
+        full.push(slot);
+    }
+    full.close();
+    for (int w = 0; w < workerCount; ++w) worker[w].join();
+    const double seconds
+        = (cv::getTickCount() - tickZero) / cv::getTickFrequency();
+    std::cout << std::endl << count << " frames in " << seconds
+              << " seconds on " << workerCount << " workers: "
+              << count / seconds << " frames/second" << std::endl;
+}
+
+// The running totals of the comparisons of one candidate to reference.
+// Frames identical to the reference have no PSNR, and MSSIM 1.
+//
+struct Summary {
+    int frameCount;                     // frames compared
+    int emptyCount;                     // frames missing from either
+    int psnrCount;                      // frames with a PSNR
+    double psnrSum;                     // the sum of their PSNRs
+    double psnrMin;                     // the least of their PSNRs
+    int ssimCount;                      // frames with an MSSIM
+    double ssimSum;                     // the sum of their MSSIMs
+    double ssimMin;                     // the least of their MSSIMs
+
+    // Add comparison c.
+    //
+    void add(const Comparison &c) {
+        const int channels = c.channels;
+        ++frameCount;
+        if (c.empty) { ++emptyCount; return; }
+        if (c.psnr > 0.0) {
+            ++psnrCount;
+            psnrSum += c.psnr;
+            psnrMin = std::min(psnrMin, c.psnr);
+        }
+        double ssim = 1.0;
+        if (c.ssim) {
+            ssim = 0.0;
+            for (int i = 0; i < channels; ++i) ssim += c.mssim.val[i];
+            ssim /= channels;
+        }
+        ++ssimCount;
+        ssimSum += ssim;
+        ssimMin = std::min(ssimMin, ssim);
+    }
+
+    Summary():
+        frameCount(0), emptyCount(0),
+        psnrCount(0), psnrSum(0.0),
+        psnrMin(std::numeric_limits<double>::max()),
+        ssimCount(0), ssimSum(0.0), ssimMin(1.0)
+    {}
+};
+
+// Return s quoted for CSV.
+//
+static std::string csvQuote(const std::string &s)
+{
+    std::string result("\"");
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] == '"') result += '"';
+        result += s[i];
+    }
+    return result + "\"";
+}
+
+// Write comparison c to candidate name as a row of CSV on os.  Leave PSNR
+// blank for identical frames and channels, every value blank for empty
+// frames, and the channels blank that the frames do not have.
+//
+static void writeCsv(std::ostream &os, const std::string &name,
+                     const Comparison &c)
+{
+    os << csvQuote(name) << "," << c.frame << ","
+       << (c.empty ? "empty" : c.psnr > 0.0 ? "" : "identical");
+    for (int i = 0; i < 4; ++i) {
+        const double psnr = i ? c.channelPsnr.val[i - 1] : c.psnr;
+        os << ",";
+        if (!c.empty && i <= c.channels && psnr > 0.0) os << psnr;
+    }
+    const cv::Scalar mssim = c.ssim ? c.mssim : cv::Scalar::all(1.0);
+    double mean = 0.0;
+    for (int i = 0; i < c.channels; ++i) mean += mssim.val[i];
+    if (c.channels) mean /= c.channels;
+    for (int i = 0; i < 4; ++i) {
+        os << ",";
+        if (!c.empty && i <= c.channels) os << (i ? mssim.val[i - 1] : mean);
+    }
+    os << std::endl;
+}
+
+// Compare every candidate to reference for each frame on one thread per
+// candidate.  Each candidate has its own SsimEngine, and resizes its
+// frame to the reference frame when they differ, as for the rungs of an
+// encoding ladder.
+//
+struct CompareCandidates: cv::ParallelLoopBody {
+    const cv::Mat &reference;
+    std::vector<std::unique_ptr<CvVideoCapture> > &candidate;
+    std::vector<SsimEngine> &engine;
+    std::vector<cv::Mat> &frame;
+    std::vector<Comparison> &comparison;
+    const int n;
+    void operator()(const cv::Range &range) const {
+        static const int trigger = std::numeric_limits<int>::max();
+        for (int i = range.start; i < range.end; ++i) {
+            *candidate[i] >> frame[i];
+            if (!frame[i].empty() && frame[i].size() != reference.size()) {
+                cv::resize(frame[i], frame[i], reference.size());
+            }
+            comparison[i]
+                = compareFrames(engine[i], n, reference, frame[i], trigger);
+        }
+    }
+    CompareCandidates(const cv::Mat &r,
+                      std::vector<std::unique_ptr<CvVideoCapture> > &c,
+                      std::vector<SsimEngine> &e, std::vector<cv::Mat> &f,
+                      std::vector<Comparison> &o, int i):
+        reference(r), candidate(c), engine(e), frame(f), comparison(o), n(i)
+    {}
+};
+
+// Compare every frame of reference to the same frame of each of the
+// candidates named in candidateName with PSNR and MSSIM, decoding the
+// reference only once.  Read until the reference ends or every candidate
+// has, whatever count of frames the containers claim.  Write each
+// comparison to <stem>-frames.csv and the Summary of each candidate to
+// <stem>-summary.csv.  Return false if either file cannot be written.
+//
+static bool batchVideos(const std::string &stem, CvVideoCapture &reference,
+                        const std::vector<std::string> &candidateName,
+                        int scale)
+{
+    const int count = candidateName.size();
+    std::vector<std::unique_ptr<CvVideoCapture> > candidate;
+    for (int i = 0; i < count; ++i) {
+        candidate.emplace_back(new CvVideoCapture(candidateName[i]));
+        if (!candidate.back()->isOpened()) {
+            std::cerr << "Cannot open " << candidateName[i] << std::endl;
+        }
+    }
+    const std::string framesName = stem + "-frames.csv";
+    const std::string summaryName = stem + "-summary.csv";
+    std::ofstream frames(framesName.c_str());
+    frames << "candidate,frame,note,psnr,psnr_b,psnr_g,psnr_r,"
+           << "mssim,mssim_b,mssim_g,mssim_r" << std::endl
+           << std::setprecision(6);
+    std::vector<SsimEngine> engine(count, SsimEngine(scale));
+    std::vector<cv::Mat> frame(count);
+    std::vector<Comparison> comparison(count);
+    std::vector<Summary> summary(count);
+    const int64 tickZero = cv::getTickCount();
+    cv::Mat rFrame;
+    int n = 0;
+    for (bool more = true; more && reference.read(rFrame); ++n) {
+        cv::parallel_for_(cv::Range(0, count),
+                          CompareCandidates(rFrame, candidate, engine,
+                                            frame, comparison, n),
+                          count);
+        more = false;
+        for (int i = 0; i < count; ++i) {
+            summary[i].add(comparison[i]);
+            writeCsv(frames, candidateName[i], comparison[i]);
+            more = more || !frame[i].empty();
+        }
+    }
+    const double seconds
+        = (cv::getTickCount() - tickZero) / cv::getTickFrequency();
+    std::ofstream os(summaryName.c_str());
+    os << "candidate,frames,empty,psnr_frames,mean_psnr,min_psnr,"
+       << "mean_mssim,min_mssim" << std::endl << std::setprecision(6);
+    for (int i = 0; i < count; ++i) {
+        const Summary &s = summary[i];
+        os << csvQuote(candidateName[i]) << "," << s.frameCount
+           << "," << s.emptyCount << "," << s.psnrCount << ",";
+        if (s.psnrCount) os << s.psnrSum / s.psnrCount << "," << s.psnrMin;
+        else os << ",";
+        os << ",";
+        if (s.ssimCount) os << s.ssimSum / s.ssimCount << "," << s.ssimMin;
+        else os << ",";
+        os << std::endl;
+        std::cout << candidateName[i] << ":   PSNR:"
+                  << DECIBEL(s.psnrCount ? s.psnrSum / s.psnrCount : 0.0)
+                  << ",   MSSIM:"
+                  << PERCENT(s.ssimCount ? s.ssimSum / s.ssimCount : 0.0)
+                  << std::endl;
+    }
+    std::cout << std::endl << n << " frames of " << count
+              << " candidates in " << seconds << " seconds: "
+              << n / seconds << " frames/second" << std::endl;
+    if (!frames) std::cerr << "Cannot write " << framesName << std::endl;
+    if (!os) std::cerr << "Cannot write " << summaryName << std::endl;
+    return frames && os;
+}
+
+// Remove option and the number after it from the ac arguments in av, and
+// return true with the number in value, or return false if option is not
+// there.
+//
+static bool takeOption(int &ac, char *av[], const char *option, int &value)
+{
+    bool result = false;
+    int out = 0;
+    for (int in = 0; in < ac; ++in) {
+        if (0 == strcmp(av[in], option) && in + 1 < ac) {
+            value = atoi(av[++in]);
+            result = true;
+        } else {
+            av[out++] = av[in];
+        }
+    }
+    ac = out;
+    return result;
+}
+
+// Return the Alignment of test to reference found from the perceptual
+// hashes of their frames, trying offsets of up to maxOffset frames, and
+// rewind both.
+//
+// Hash only the first span frames of test, and the reference frames they
+// could show, so the frames decoded twice are bounded by span and
+// maxOffset rather than the length of the videos.
+//
+static Alignment alignVideos(CvVideoCapture &reference, CvVideoCapture &test,
+                             int maxOffset, int span)
+{
+    static const double maxRate = 1.05;
+    const int64 tickZero = cv::getTickCount();
+    const int rSpan = maxOffset + int(maxRate * span) + 1;
+    std::vector<uint64> rHash, tHash;
+    std::thread hasher(hashVideo, std::ref(test), span, std::ref(tHash));
+    hashVideo(reference, rSpan, rHash);
+    hasher.join();
+    const Alignment result = searchAlignment(rHash, tHash, maxOffset);
+    const double seconds
+        = (cv::getTickCount() - tickZero) / cv::getTickFrequency();
+    std::cout << std::setiosflags(std::ios::fixed) << std::setprecision(3)
+              << "Aligned in " << seconds << " seconds: test frame j shows"
+              << " reference frame " << result.offset << " + "
+              << result.rate << " * j at a mean Hamming distance of "
+              << result.distance << " bits." << std::endl;
+    return result;
+}
+
 int main(int ac, char *av[])
 {
-    if (ac == 4) {
+    int scale = 0, maxOffset = 0, span = 300;
+    if (takeOption(ac, av, "--fast", scale)) scale = std::max(1, scale);
+    const bool align = takeOption(ac, av, "--align", maxOffset);
+    takeOption(ac, av, "--span", span);
+    if (ac >= 5 && 0 == strcmp(av[1], "--batch") && !align) {
+        CvVideoCapture reference(av[3]);
+        if (reference.isOpened()) {
+            const std::vector<std::string> candidate(av + 4, av + ac);
+            const cv::Size size = reference.getFrameSize();
+            std::cout << std::endl << reference.getFrameCount()
+                      << " frames (W x H): "
+                      << size.width << " x " << size.height
+                      << " against " << candidate.size() << " candidates."
+                      << std::endl << std::endl;
+            return batchVideos(av[2], reference, candidate, scale) ? 0 : 1;
+        }
+    }
+    const bool pipeline = ac == 6 && 0 == strcmp(av[4], "--pipeline");
+    if (ac == 4 || pipeline) {
         std::stringstream s; s << av[3] << std::ends;
         int trigger = 0; s >> trigger;
+        int workerCount = pipeline ? atoi(av[5]) : 0;
+        if (workerCount < 1) workerCount = cv::getNumberOfCPUs();
         CvVideoCapture reference(av[1]);
         CvVideoCapture test(av[2]);
         const bool ok = trigger
             && reference.isOpened() && test.isOpened()
-            && reference.size() == test.size();
-        const cv::Size size = reference.size();
+            && reference.getFrameSize() == test.getFrameSize();
+        const cv::Size size = reference.getFrameSize();
+        const Alignment alignment = ok && align
+            ? alignVideos(reference, test, std::max(0, maxOffset),
+                          std::max(1, span))
+            : Alignment();
+        if (ok && pipeline) {
+            std::cout << std::endl << reference.getFrameCount()
+                      << " frames (W x H): "
+                      << size.width << " x " << size.height
+                      << " with PSNR trigger " << trigger
+                      << " on " << workerCount << " workers."
+                      << std::endl << std::endl;
+            pipelineVideos(reference, test, alignment,
+                           trigger, workerCount, scale);
+            return 0;
+        }
         if (ok) {
-            const int msDelay = 1000 / reference.framesPerSecond();
+            const int msDelay = 1000 / reference.getFramesPerSecond();
             std::cout << std::endl << av[0] << ": Press any key to quit."
                       << std::endl << std::endl
-                      << reference.count() << " frames (W x H): "
+                      << reference.getFrameCount() << " frames (W x H): "
                       << size.width << " x " << size.height
                       << " with PSNR trigger " << trigger
                       << " and delay " << msDelay << " milliseconds."
                       << std::endl << std::endl;
-            compareVideos(reference, test, trigger, msDelay);
+            compareVideos(reference, test, alignment,
+                          trigger, msDelay, scale);
             return 0;
         }
     }
@@ -1,14 +1,30 @@
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 
+#include "capture.hpp"
+
 
 static void showUsage(const char *av0)
 {
     std::cout << av0 << ": Extract, write, and display video color channels."
               << std::endl << std::endl
               << "Usage: " << av0 << " <input> <r-out> <g-out> <b-out>"
+              << std::endl
+              << "   or: " << av0 << " --chunks <workers>"
+              << " <input> <r-out> <g-out> <b-out>"
               << std::endl << std::endl
               << "Where: <input> is a color video file." << std::endl
               << "       <b-out> is where to write the blue channel."
@@ -16,9 +32,24 @@ static void showUsage(const char *av0)
               << "       <g-out> is where to write the green channel."
               << std::endl
               << "       <r-out> is where to write the red channel."
+              << std::endl
+              << "       <workers> is the number of threads writing"
+              << std::endl
+              << "                 segments of each channel in parallel,"
+              << std::endl
+              << "                 or 0 for one per CPU.  The segments"
+              << std::endl
+              << "                 are joined in order into each <out>"
+              << std::endl
+              << "                 by running ffmpeg, which must be on"
+              << std::endl
+              << "                 the PATH."
               << std::endl << std::endl
               << "Example: " << av0 << " ../resources/Megamind.avi"
               << " red.avi green.avi blue.avi"
+              << std::endl
+              << "Example: " << av0 << " --chunks 0 ../resources/Megamind.avi"
+              << " red.avi green.avi blue.avi"
               << std::endl << std::endl;
 }
 
@@ -46,51 +77,16 @@ static void makeWindow(const char *window, cv::Size size, int reset = 0)
     maxY = std::max(maxY, size.height);
 }
 
-// Just cv::VideoCapture extended for convenience.
-//
-struct CvVideoCapture: cv::VideoCapture {
-    double framesPerSecond() {
-        return this->get(cv::CAP_PROP_FPS);
-    }
-    int fourCcCodec() {
-        return this->get(cv::CAP_PROP_FOURCC);
-    }
-    const char *fourCcCodecString() {
-        static int code = 0;
-        static char result[5] = "";
-        if (code == 0) {
-            code = this->fourCcCodec();
-            result[0] = ((code & 0x000000ff) >>  0);
-            result[1] = ((code & 0x0000ff00) >>  8);
-            result[2] = ((code & 0x00ff0000) >> 16);
-            result[3] = ((code & 0xff000000) >> 24);
-            result[4] = ""[0];
-        }
-        return result;
-    }
-    int frameCount() {
-        return this->get(cv::CAP_PROP_FRAME_COUNT);
-    }
-    cv::Size frameSize() {
-        const int w = this->get(cv::CAP_PROP_FRAME_WIDTH);
-        const int h = this->get(cv::CAP_PROP_FRAME_HEIGHT);
-        const cv::Size result(w, h);
-        return result;
-    }
-    CvVideoCapture(const std::string &fileName): VideoCapture(fileName) {}
-    CvVideoCapture(): VideoCapture() {}
-};
-
 // Open ac VideoWriter files like vc named on av into vw.
 // Return true unless something goes wrong.
 //
-static bool openChannelFiles(int ac, char *av[],
+static bool openChannelFiles(int ac, const char *const av[],
                              CvVideoCapture &vc, cv::VideoWriter vw[])
 {
     static const bool isColor = true;
-    const int codec = vc.fourCcCodec();
-    const double fps = vc.framesPerSecond();
-    const cv::Size size = vc.frameSize();
+    const int codec = vc.getFourCcCodec();
+    const double fps = vc.getFramesPerSecond();
+    const cv::Size size = vc.getFrameSize();
     for (int i = 0; i < ac; ++i) {
         vw[i].open(av[i], codec, fps, size, isColor);
     }
@@ -98,28 +94,273 @@ static bool openChannelFiles(int ac, char *av[],
     return true;
 }
 
+// Copy each of the count channels of the 8-bit input into the same
+// channel of output[channel], with every other channel of output[channel]
+// black, in one pass over input.  Reuse output frames of the right size.
+//
+static void isolateChannels(const cv::Mat &input, int count,
+                            cv::Mat *output[])
+{
+    CV_Assert(input.depth() == CV_8U && input.channels() == count);
+    std::vector<uchar *> q(count);
+    for (int c = 0; c < count; ++c) {
+        output[c]->create(input.size(), input.type());
+    }
+    for (int r = 0; r < input.rows; ++r) {
+        const uchar *p = input.ptr(r);
+        for (int c = 0; c < count; ++c) q[c] = output[c]->ptr(r);
+        if (count == 3) {
+            uchar *q0 = q[0], *q1 = q[1], *q2 = q[2];
+            for (int x = 0; x < input.cols; ++x, p += 3) {
+                q0[0] = p[0]; q0[1] = 0;    q0[2] = 0;    q0 += 3;
+                q1[0] = 0;    q1[1] = p[1]; q1[2] = 0;    q1 += 3;
+                q2[0] = 0;    q2[1] = 0;    q2[2] = p[2]; q2 += 3;
+            }
+            continue;
+        }
+        for (int x = 0; x < input.cols; ++x, p += count) {
+            for (int c = 0; c < count; ++c) {
+                for (int i = 0; i < count; ++i) q[c][i] = i == c ? p[i] : 0;
+                q[c] += count;
+            }
+        }
+    }
+}
+
+// Write frames to a VideoWriter on a thread of its own.  The frames wait
+// in a ring of depth preallocated frames, so the producer blocks only when
+// the encoder falls depth frames behind.
+//
+// The producer fills the frame next() returns and then calls push().
+//
+class Encoder {
+    cv::VideoWriter &writer;            // written only by the thread
+    std::vector<cv::Mat> ring;          // frames pushed but not written
+    size_t head;                        // the oldest frame in ring
+    size_t count;                       // the number of frames in ring
+    bool closed;                        // true when no more will be pushed
+    std::mutex mutex;                   // guards all of the above
+    std::condition_variable ready;      // a frame is in ring or closed
+    std::condition_variable room;       // ring has room
+    std::thread thread;                 // runs encode()
+
+    // Write the frames in ring until closed and empty.
+    //
+    void encode(void) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            ready.wait(lock, [this]{ return closed || count; });
+            if (count == 0) return;
+            cv::Mat &frame = ring[head];
+            lock.unlock();
+            writer << frame;
+            lock.lock();
+            head = (head + 1) % ring.size();
+            --count;
+            room.notify_one();
+        }
+    }
+
+    Encoder(const Encoder &);
+    Encoder &operator=(const Encoder &);
+
+public:
+
+    // Return the next free frame in ring, waiting for room if necessary.
+    //
+    cv::Mat &next(void) {
+        std::unique_lock<std::mutex> lock(mutex);
+        room.wait(lock, [this]{ return count < ring.size(); });
+        return ring[(head + count) % ring.size()];
+    }
+
+    // Queue the frame last returned by next() for writing.
+    //
+    void push(void) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++count;
+        ready.notify_one();
+    }
+
+    // Write the frames left in ring and stop the thread.
+    //
+    ~Encoder() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        ready.notify_one();
+        thread.join();
+    }
+
+    Encoder(cv::VideoWriter &w, int depth = 4):
+        writer(w), ring(std::max(1, depth)), head(0), count(0), closed(false),
+        thread(&Encoder::encode, this)
+    {}
+};
+
 // Separate the count channels of input into output.
 //
+// Each frame of input is read once to fill a frame for every output, and
+// each output is encoded on its own thread while input decodes on another.
+//
 static void separateChannels(int count, CvVideoCapture &input,
                              cv::VideoWriter output[])
 {
-    while (true) {
-        cv::Mat inFrame;
-        input >> inFrame;
-        if (inFrame.empty()) break;
-        for (int color = 0; color < count; ++color) {
-            std::vector<cv::Mat> channel;
-            cv::split(inFrame, channel);
-            const cv::Mat black
-                = cv::Mat::zeros(channel[0].size(), channel[0].type());
-            for (int i = 0; i < channel.size(); ++i) {
-                if (i != color) channel[i] = black;
-            }
-            cv::Mat outFrame;
-            cv::merge(channel, outFrame);
-            output[color] << outFrame;
+    std::vector<std::unique_ptr<Encoder> > encoder;
+    for (int c = 0; c < count; ++c) {
+        encoder.emplace_back(new Encoder(output[c]));
+    }
+    std::vector<cv::Mat *> outFrame(count);
+    cv::Mat inFrame;
+    while (input.read(inFrame)) {
+        for (int c = 0; c < count; ++c) outFrame[c] = &encoder[c]->next();
+        isolateChannels(inFrame, count, outFrame.data());
+        for (int c = 0; c < count; ++c) encoder[c]->push();
+    }
+}
+
+// Return the name of segment k of the file named name: the name with -k
+// in 3 digits before its extension.
+//
+static std::string segmentName(const std::string &name, int k)
+{
+    const size_t dot = name.find_last_of('.');
+    const size_t slash = name.find_last_of('/');
+    const bool ext = dot != std::string::npos
+        && (slash == std::string::npos || dot > slash);
+    char number[16];
+    snprintf(number, sizeof number, "-%03d", k);
+    if (!ext) return name + number;
+    return name.substr(0, dot) + number + name.substr(dot);
+}
+
+// Return the name of the list of the segments of the file named name: the
+// name with its extension replaced by .txt.
+//
+static std::string listName(const std::string &name)
+{
+    const size_t dot = name.find_last_of('.');
+    const size_t slash = name.find_last_of('/');
+    const bool ext = dot != std::string::npos
+        && (slash == std::string::npos || dot > slash);
+    return (ext ? name.substr(0, dot) : name) + ".txt";
+}
+
+// Separate the count channels of frames [begin, end) of the video named
+// input into segment k of each of the count files named in output.  Read
+// to the end of input when end is INT_MAX.  Return true unless something
+// goes wrong.
+//
+// The worker opens its own capture and seeks it with CAP_PROP_POS_FRAMES,
+// so it shares nothing with the other workers.  Seeking lands on the
+// exact frame only where the backend can decode from there.
+//
+static bool separateChunk(const char *input, int count,
+                          const char *const output[],
+                          int k, int begin, int end)
+{
+    CvVideoCapture vc(input);
+    if (!vc.isOpened()) return false;
+    vc.setPosition(begin);
+    std::vector<std::string> name(count);
+    std::vector<const char *> segment(count);
+    for (int c = 0; c < count; ++c) {
+        name[c] = segmentName(output[c], k);
+        segment[c] = name[c].c_str();
+    }
+    std::vector<cv::VideoWriter> vw(count);
+    if (!openChannelFiles(count, segment.data(), vc, vw.data())) return false;
+    std::vector<cv::Mat> outFrame(count);
+    std::vector<cv::Mat *> out(count);
+    for (int c = 0; c < count; ++c) out[c] = &outFrame[c];
+    cv::Mat inFrame;
+    for (int f = begin; f < end && vc.read(inFrame); ++f) {
+        isolateChannels(inFrame, count, out.data());
+        for (int c = 0; c < count; ++c) vw[c] << outFrame[c];
+    }
+    return true;
+}
+
+// Return s quoted for the shell, which is also how the lists read by the
+// ffmpeg concat demuxer quote file names.
+//
+static std::string shellQuote(const std::string &s)
+{
+    std::string result("'");
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] == '\'') result += "'\\'";
+        result += s[i];
+    }
+    return result + "'";
+}
+
+// Join the segmentCount segments of the file named name, listed in order
+// in listName(name), into name.  Remove the segments and the list once
+// they are joined.  Return true unless something goes wrong.
+//
+// VideoWriter cannot copy encoded frames from one file to another, and
+// joining the segments by decoding and encoding them again would undo
+// the parallel speedup.  So run the ffmpeg concat demuxer, which joins
+// the segments without encoding them again.
+//
+static bool joinSegments(const std::string &name, int segmentCount)
+{
+    const std::string list = listName(name);
+    const std::string command
+        = "ffmpeg -loglevel error -y -f concat -safe 0 -i "
+        + shellQuote(list) + " -c copy " + shellQuote(name);
+    if (0 != std::system(command.c_str())) {
+        std::cerr << "Cannot join the segments of " << name
+                  << " with: " << command << std::endl;
+        return false;
+    }
+    for (int k = 0; k < segmentCount; ++k) {
+        std::remove(segmentName(name, k).c_str());
+    }
+    std::remove(list.c_str());
+    return true;
+}
+
+// Separate the count channels of the video named input into count files
+// named in output, cut into one segment per worker.  Each of workerCount
+// threads separates one range of frames into its own segment files, and
+// the last reads to the end of input in case frameCount is short.  Then
+// list the segments of each output in order in a .txt file named for the
+// output, and join them into the output.  Return true unless something
+// goes wrong.
+//
+static bool separateChunks(const char *input, int frameCount, int count,
+                           const char *const output[], int workerCount)
+{
+    workerCount = std::max(1, std::min(workerCount, frameCount));
+    std::vector<std::thread> worker;
+    std::vector<char> ok(workerCount, false);
+    for (int k = 0; k < workerCount; ++k) {
+        const int begin = int(int64(frameCount) * k / workerCount);
+        const int end = k == workerCount - 1
+            ? INT_MAX : int(int64(frameCount) * (k + 1) / workerCount);
+        worker.push_back(std::thread([=, &ok]{
+            ok[k] = separateChunk(input, count, output, k, begin, end);
+        }));
+    }
+    bool result = true;
+    for (int k = 0; k < workerCount; ++k) {
+        worker[k].join();
+        result = result && ok[k];
+    }
+    for (int c = 0; c < count; ++c) {
+        std::ofstream os(listName(output[c]).c_str());
+        for (int k = 0; k < workerCount; ++k) {
+            const std::string segment = segmentName(output[c], k);
+            const size_t slash = segment.find_last_of('/');
+            os << "file " << shellQuote(segment.substr(slash + 1))
+               << std::endl;
         }
+        os.close();
+        result = result && os && joinSegments(output[c], workerCount);
     }
+    return result;
 }
 
 // Play the ac VideoCapture files named in av[].
@@ -136,9 +377,9 @@ static void playVideo(int ac, char *av[])
     }
     if (ok) {
         for (int i = 0; ok && i < ac; ++i) {
-            makeWindow(video[i].name, video[i].vc.frameSize(), i == 0? 2: 0);
+            makeWindow(video[i].name, video[i].vc.getFrameSize(), i == 0? 2: 0);
         }
-        const int msFrameDelay = 1.0 / video[0].vc.framesPerSecond() * 1000;
+        const int msFrameDelay = 1.0 / video[0].vc.getFramesPerSecond() * 1000;
         while (ok) {
             for (int i = 0; ok && i < ac; ++i) {
                 video[i].vc >> video[i].frame;
@@ -156,6 +397,28 @@ static void playVideo(int ac, char *av[])
 int main(int ac, char *av[])
 {
     enum { BLUE, GREEN, RED, COUNT };
+    if (ac == 4 + COUNT && 0 == strcmp(av[1], "--chunks")) {
+        int workerCount = atoi(av[2]);
+        if (workerCount < 1) workerCount = cv::getNumberOfCPUs();
+        const char *const input = av[3];
+        const char *const *const output = av + 4;
+        CvVideoCapture vc(input);
+        const int frameCount = vc.getFrameCount();
+        if (vc.isOpened() && frameCount > 0) {
+            vc.release();
+            const int64 tickZero = cv::getTickCount();
+            workerCount = std::min(workerCount, frameCount);
+            const bool ok = separateChunks(input, frameCount, COUNT, output,
+                                           workerCount);
+            const double seconds
+                = (cv::getTickCount() - tickZero) / cv::getTickFrequency();
+            std::cout << std::endl << frameCount << " frames in " << seconds
+                      << " seconds on " << workerCount << " workers: "
+                      << frameCount / seconds << " frames/second"
+                      << std::endl << std::endl;
+            return ok ? 0 : 1;
+        }
+    }
     if (ac == 2 + COUNT) {
         cv::VideoWriter output[COUNT];
         CvVideoCapture input(av[1]);
@@ -165,11 +428,11 @@ int main(int ac, char *av[])
             separateChannels(COUNT, input, output);
             std::cout << std::endl << av[0] << ": Press any key to quit."
                       << std::endl << std::endl
-                      << input.frameCount() << " frames ("
-                      << input.frameSize().width << " x "
-                      << input.frameSize().height
-                      << ") with codec " << input.fourCcCodecString()
-                      << " at " << input.framesPerSecond()
+                      << input.getFrameCount() << " frames ("
+                      << input.getFrameSize().width << " x "
+                      << input.getFrameSize().height
+                      << ") with codec " << input.getFourCcCodecString()
+                      << " at " << input.getFramesPerSecond()
                       << " frames/second." << std::endl << std::endl;
             playVideo(ac - 1, av + 1);
             return 0;